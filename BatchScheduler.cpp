@@ -0,0 +1,96 @@
+/**
+ * @file BatchScheduler.cpp
+ * @brief Collects digits of concurrent requests into shared batches.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#include "BatchScheduler.h"
+#include <stdexcept>
+#include <algorithm>
+
+BatchScheduler::BatchScheduler(size_t maxBatch, std::chrono::microseconds maxWait, size_t workers) : 
+    m_MaxBatch(std::max<size_t>(maxBatch, 1)), m_MaxWait(maxWait) {
+    for(size_t i = 0; i < std::max<size_t>(workers, 1); i++)
+        m_Workers.emplace_back(&BatchScheduler::run, this);
+}
+
+BatchScheduler::~BatchScheduler() {
+    {
+        std::lock_guard<std::mutex> lck(m_Mutex);
+        m_Stop = true;
+    }
+    m_Pending.notify_all();
+    for(auto& worker : m_Workers)
+        worker.join();
+}
+
+std::future<BatchScheduler::Probabilities> BatchScheduler::submit(InferenceBackend::SPtr backend, Digits digits) {
+    Request req;
+    req.backend = std::move(backend);
+    req.digits = std::move(digits);
+    req.arrival = std::chrono::steady_clock::now();
+    std::future<Probabilities> fut = req.result.get_future();
+    {
+        std::lock_guard<std::mutex> lck(m_Mutex);
+        m_QueuedDigits += req.digits.size();
+        m_Queue.push_back(std::move(req));
+    }
+    m_Pending.notify_all();
+    return fut;
+}
+
+void BatchScheduler::run() {
+    std::unique_lock<std::mutex> lck(m_Mutex);
+    while(true) {
+        // wait for the first request, then until the batch is full or the oldest request waited long enough
+        m_Pending.wait(lck, [this]{ return m_Stop || !m_Queue.empty(); });
+        if(m_Queue.empty())
+            return; // stopped
+        // the deadline is taken from the current oldest request, other workers may take requests meanwhile
+        while(!m_Stop && !m_Queue.empty() && m_QueuedDigits < m_MaxBatch && std::chrono::steady_clock::now() < m_Queue.front().arrival + m_MaxWait)
+            m_Pending.wait_until(lck, m_Queue.front().arrival + m_MaxWait);
+        if(m_Queue.empty())
+            continue;
+
+        // take requests in arrival order, at least one, as long as they fit into the batch and use the same backend
+        std::vector<Request> batch;
+        size_t count = 0;
+        while(!m_Queue.empty() && (batch.empty() || (count + m_Queue.front().digits.size() <= m_MaxBatch && 
+                                                     m_Queue.front().backend == batch.front().backend))) {
+            count += m_Queue.front().digits.size();
+            batch.push_back(std::move(m_Queue.front()));
+            m_Queue.pop_front();
+        }
+        m_QueuedDigits -= count;
+        lck.unlock();
+
+        // classify all digits of the batch at once and split the results
+        Probabilities probs;
+        std::exception_ptr error;
+        try {
+            Digits digits;
+            digits.reserve(count);
+            for(auto& req : batch)
+                digits.insert(digits.end(), req.digits.begin(), req.digits.end());
+            probs = batch.front().backend->classify(digits);
+        }
+        catch(...) {
+            error = std::current_exception();
+        }
+        auto it = probs.begin();
+        for(auto& req : batch) {
+            if(error || probs.size() != count)
+                req.result.set_exception(error ? error : std::make_exception_ptr(std::runtime_error("Backend returned an invalid number of results.")));
+            else {
+                req.result.set_value(Probabilities(it, it + req.digits.size()));
+                it += req.digits.size();
+            }
+        }
+        m_Batches++;
+        m_Requests += batch.size();
+        lck.lock();
+    }
+}
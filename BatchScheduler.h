@@ -0,0 +1,91 @@
+/**
+ * @file BatchScheduler.h
+ * @brief Collects digits of concurrent requests into shared batches.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#ifndef BATCHSCHEDULER_H
+#define BATCHSCHEDULER_H
+
+#include <Object.h>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <future>
+#include <vector>
+#include <chrono>
+#include <condition_variable>
+#include "InferenceBackend.h"
+
+/**
+ * @brief Collects the digits of concurrent requests into shared batches.
+ *
+ * Requests submit their digits and receive a future. A background thread waits until
+ * maxBatch digits are pending or the oldest request waited for maxWait, classifies all
+ * pending digits using a single call of the backend and hands every request its
+ * part of the results. Only requests classified by the same backend share a batch,
+ * so a request is never answered by a different network than the one it selected
+ * (e.g. during a reload). Several background threads form and classify batches at
+ * the same time, one per network replica, so batching does not serialize the classification.
+ */
+class BatchScheduler : public giri::Object<BatchScheduler>
+{
+public:
+    using Digits = InferenceBackend::Digits;
+    using Probabilities = InferenceBackend::Probabilities;
+
+    /**
+     * @param maxBatch Maximum number of digits per batch, a single request exceeding this limit is classified on its own.
+     * @param maxWait Maximum time a request waits for other requests to join its batch.
+     * @param workers Number of batches classified at the same time, at least one.
+     */
+    BatchScheduler(size_t maxBatch, std::chrono::microseconds maxWait, size_t workers = 1);
+    ~BatchScheduler();
+
+    /**
+     * @brief Queues digits for classification.
+     * @param backend Backend classifying the digits.
+     * @param digits 28x28 images of the digits to classify.
+     * @returns Future receiving the label probabilities of the digits, in the same order as digits.
+     */
+    std::future<Probabilities> submit(InferenceBackend::SPtr backend, Digits digits);
+
+    /**
+     * @returns Number of batches classified so far.
+     */
+    unsigned long long batches() const { return m_Batches; }
+
+    /**
+     * @returns Number of requests classified so far.
+     */
+    unsigned long long requests() const { return m_Requests; }
+
+private:
+    struct Request
+    {
+        InferenceBackend::SPtr backend;
+        Digits digits;
+        std::promise<Probabilities> result;
+        std::chrono::steady_clock::time_point arrival;
+    };
+
+    void run();
+
+    size_t m_MaxBatch;
+    std::chrono::microseconds m_MaxWait;
+
+    std::mutex m_Mutex;
+    std::condition_variable m_Pending;
+    std::deque<Request> m_Queue;
+    size_t m_QueuedDigits = 0;
+    bool m_Stop = false;
+    std::atomic<unsigned long long> m_Batches{0};
+    std::atomic<unsigned long long> m_Requests{0};
+    std::vector<std::thread> m_Workers;
+};
+
+#endif // BATCHSCHEDULER_H
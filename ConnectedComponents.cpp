@@ -0,0 +1,176 @@
+/**
+ * @file ConnectedComponents.cpp
+ * @brief Single pass, run based labeling of the outer blobs of a binary image.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#include "ConnectedComponents.h"
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+namespace components
+{
+namespace
+{
+    // horizontal span of equal pixels within one row, x1 inclusive
+    struct Run
+    {
+        int y;
+        int x0;
+        int x1;
+    };
+
+    int find(std::vector<int>& parent, int i) {
+        while(parent[i] != i) {
+            parent[i] = parent[parent[i]]; // path halving
+            i = parent[i];
+        }
+        return i;
+    }
+
+    void unite(std::vector<int>& parent, int a, int b) {
+        a = find(parent, a);
+        b = find(parent, b);
+        if(a != b)
+            parent[std::max(a, b)] = std::min(a, b);
+    }
+
+    /**
+     * @brief Calls f for every pair of runs of two sorted run lists whose columns overlap,
+     * extended by d columns (d = 1 also pairs diagonal neighbours of adjacent rows).
+     */
+    template<typename F>
+    void overlapping(const std::vector<Run>& a, int ab, int ae, const std::vector<Run>& b, int bb, int be, int d, F f) {
+        int i = ab;
+        int j = bb;
+        while(i < ae && j < be) {
+            if(a[i].x0 <= b[j].x1 + d && b[j].x0 <= a[i].x1 + d)
+                f(i, j);
+            // the run ending first cannot overlap any later run of the other list
+            if(a[i].x1 < b[j].x1)
+                i++;
+            else
+                j++;
+        }
+    }
+
+    uint64_t load64(const unsigned char* p) {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+}
+
+    std::vector<Component> outerComponents(const unsigned char* img, int rows, int cols, size_t stride) {
+        std::vector<Run> fg;
+        std::vector<Run> bg;
+        std::vector<int> fgRow(rows + 1, 0); // first run of every row
+        std::vector<int> bgRow(rows + 1, 0);
+        std::vector<int> fgParent;
+        std::vector<int> bgParent;
+
+        for(int y = 0; y < rows; y++) {
+            const unsigned char* row = img + y * stride;
+            fgRow[y] = fg.size();
+            bgRow[y] = bg.size();
+
+            // foreground runs, the gaps between them are the background runs
+            int x = 0;
+            int gap = 0;
+            while(x < cols) {
+                while(x + 8 <= cols && load64(row + x) == 0)
+                    x += 8;
+                while(x < cols && row[x] == 0)
+                    x++;
+                if(x >= cols)
+                    break;
+                int start = x;
+                while(x + 8 <= cols && load64(row + x) == ~uint64_t(0))
+                    x += 8;
+                while(x < cols && row[x] != 0)
+                    x++;
+                if(start > gap)
+                    bg.push_back({ y, gap, start - 1 });
+                fg.push_back({ y, start, x - 1 });
+                gap = x;
+            }
+            if(gap < cols)
+                bg.push_back({ y, gap, cols - 1 });
+
+            for(size_t i = fgParent.size(); i < fg.size(); i++)
+                fgParent.push_back(i);
+            for(size_t i = bgParent.size(); i < bg.size(); i++)
+                bgParent.push_back(i);
+
+            // merge with the previous row, foreground is 8-connected and background 4-connected
+            if(y > 0) {
+                overlapping(fg, fgRow[y - 1], fgRow[y], fg, fgRow[y], fg.size(), 1, [&](int a, int b) { unite(fgParent, a, b); });
+                overlapping(bg, bgRow[y - 1], bgRow[y], bg, bgRow[y], bg.size(), 0, [&](int a, int b) { unite(bgParent, a, b); });
+            }
+        }
+        fgRow[rows] = fg.size();
+        bgRow[rows] = bg.size();
+
+        // background connected to the image border is outside of every blob, all other background regions are holes
+        std::vector<char> outside(bg.size(), 0);
+        for(size_t i = 0; i < bg.size(); i++)
+            if(bg[i].y == 0 || bg[i].y == rows - 1 || bg[i].x0 == 0 || bg[i].x1 == cols - 1)
+                outside[find(bgParent, i)] = 1;
+
+        // blobs touching the border or the outside background are outer blobs
+        std::vector<char> outer(fg.size(), 0);
+        auto touchesOutside = [&](int f, int b) {
+            if(outside[find(bgParent, b)])
+                outer[find(fgParent, f)] = 1;
+        };
+        for(int y = 0; y < rows; y++) {
+            for(int i = fgRow[y]; i < fgRow[y + 1]; i++)
+                if(y == 0 || y == rows - 1 || fg[i].x0 == 0 || fg[i].x1 == cols - 1)
+                    outer[find(fgParent, i)] = 1;
+            overlapping(fg, fgRow[y], fgRow[y + 1], bg, bgRow[y], bgRow[y + 1], 1, touchesOutside);
+            if(y > 0)
+                overlapping(fg, fgRow[y], fgRow[y + 1], bg, bgRow[y - 1], bgRow[y], 0, touchesOutside);
+            if(y < rows - 1)
+                overlapping(fg, fgRow[y], fgRow[y + 1], bg, bgRow[y + 1], bgRow[y + 2], 0, touchesOutside);
+        }
+
+        // accumulate bounding box, pixel count and centroid of every outer blob
+        std::vector<int> index(fg.size(), -1);
+        std::vector<Component> result;
+        std::vector<int> right;
+        std::vector<int> bottom;
+        for(size_t i = 0; i < fg.size(); i++) {
+            int root = find(fgParent, i);
+            if(!outer[root])
+                continue;
+            if(index[root] < 0) {
+                index[root] = result.size();
+                result.push_back(Component());
+                result.back().x = fg[i].x0;
+                result.back().y = fg[i].y;
+                right.push_back(fg[i].x1);
+                bottom.push_back(fg[i].y);
+            }
+            int c = index[root];
+            Component& comp = result[c];
+            size_t len = fg[i].x1 - fg[i].x0 + 1;
+            comp.x = std::min(comp.x, fg[i].x0);
+            right[c] = std::max(right[c], fg[i].x1);
+            bottom[c] = fg[i].y; // runs are visited row by row
+            comp.pixels += len;
+            comp.cx += len * (fg[i].x0 + fg[i].x1) / 2.0;
+            comp.cy += static_cast<double>(len) * fg[i].y;
+        }
+        for(size_t c = 0; c < result.size(); c++) {
+            result[c].width = right[c] - result[c].x + 1;
+            result[c].height = bottom[c] - result[c].y + 1;
+            result[c].cx /= result[c].pixels;
+            result[c].cy /= result[c].pixels;
+        }
+        return result;
+    }
+}
@@ -0,0 +1,48 @@
+/**
+ * @file ConnectedComponents.h
+ * @brief Single pass, run based labeling of the outer blobs of a binary image.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#ifndef CONNECTEDCOMPONENTS_H
+#define CONNECTEDCOMPONENTS_H
+
+#include <cstddef>
+#include <vector>
+
+namespace components
+{
+    /**
+     * @brief Connected blob of foreground pixels.
+     */
+    struct Component
+    {
+        int x = 0;          // bounding box
+        int y = 0;
+        int width = 0;
+        int height = 0;
+        size_t pixels = 0;  // number of foreground pixels
+        double cx = 0;      // centroid
+        double cy = 0;
+    };
+
+    /**
+     * @brief Finds the outer blobs of a binary image, the blobs findContours(RETR_TREE) reports without parent.
+     *
+     * Foreground pixels (non zero) are 8-connected, background pixels 4-connected, the image is surrounded by background.
+     * Blobs lying within a hole of another blob (e.g. a speck within a 0) are not reported.
+     * The image is read once, row by row: foreground and background runs are merged with the runs of the previous row
+     * using union-find, no boundary points or label image are stored. Zero and 255 spans are skipped 8 pixels at a time.
+     * @param img Binary image (row major, 8 bit).
+     * @param rows Number of rows.
+     * @param cols Number of columns.
+     * @param stride Distance between two rows in bytes.
+     * @returns Bounding box, pixel count and centroid of every outer blob, in no particular order.
+     */
+    std::vector<Component> outerComponents(const unsigned char* img, int rows, int cols, size_t stride);
+}
+
+#endif // CONNECTEDCOMPONENTS_H
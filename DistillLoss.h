@@ -0,0 +1,114 @@
+/**
+ * @file DistillLoss.h
+ * @brief dlib loss layer training a network on the soft targets of a teacher network.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#ifndef DISTILLLOSS_H
+#define DISTILLLOSS_H
+
+#include <cmath>
+#include <algorithm>
+#include <string>
+#include <dlib/dnn.h>
+
+/**
+ * @brief Loss layer for knowledge distillation.
+ *
+ * Every training label is a probability distribution over all classes (the soft targets),
+ * usually the softmax of the teacher outputs divided by the temperature, blended with the
+ * one hot encoded true label. The loss is the cross entropy between the targets and the
+ * softmax of the network outputs divided by the same temperature, scaled by temperature^2
+ * so the gradient magnitude does not depend on the temperature.
+ *
+ * Like loss_multiclass_log the network outputs the index of the largest output.
+ */
+class loss_distill_
+{
+public:
+    typedef dlib::matrix<float, 0, 1> training_label_type;
+    typedef unsigned long output_label_type;
+
+    loss_distill_(float temperature = 4.0f) : m_Temperature(temperature) {}
+
+    float temperature() const { return m_Temperature; }
+
+    template<typename SUB_TYPE, typename label_iterator>
+    void to_label(const dlib::tensor& input_tensor, const SUB_TYPE& sub, label_iterator iter) const {
+        const dlib::tensor& output_tensor = sub.get_output();
+        DLIB_CASSERT(sub.sample_expansion_factor() == 1);
+        DLIB_CASSERT(output_tensor.nr() == 1 && output_tensor.nc() == 1);
+        DLIB_CASSERT(input_tensor.num_samples() == output_tensor.num_samples());
+        const float* out = output_tensor.host();
+        const long k = output_tensor.k();
+        for(long i = 0; i < output_tensor.num_samples(); i++)
+            *iter++ = std::max_element(out + i * k, out + (i + 1) * k) - (out + i * k);
+    }
+
+    template<typename const_label_iterator, typename SUBNET>
+    double compute_loss_value_and_gradient(const dlib::tensor& input_tensor, const_label_iterator truth, SUBNET& sub) const {
+        const dlib::tensor& output_tensor = sub.get_output();
+        dlib::tensor& grad = sub.get_gradient_input();
+        DLIB_CASSERT(sub.sample_expansion_factor() == 1);
+        DLIB_CASSERT(input_tensor.num_samples() != 0);
+        DLIB_CASSERT(input_tensor.num_samples() == grad.num_samples());
+        DLIB_CASSERT(input_tensor.num_samples() == output_tensor.num_samples());
+        DLIB_CASSERT(output_tensor.nr() == 1 && output_tensor.nc() == 1);
+
+        const long k = output_tensor.k();
+        const double scale = 1.0 / output_tensor.num_samples();
+        const float* out = output_tensor.host();
+        float* g = grad.host();
+        double loss = 0;
+        for(long i = 0; i < output_tensor.num_samples(); i++, ++truth) {
+            const training_label_type& target = *truth;
+            DLIB_CASSERT(target.size() == k, "Soft targets do not match the number of network outputs.");
+
+            // softmax of the outputs softened by the temperature
+            const float* z = out + i * k;
+            const float m = *std::max_element(z, z + k) / m_Temperature;
+            double sum = 0;
+            for(long j = 0; j < k; j++)
+                sum += std::exp(z[j] / m_Temperature - m);
+            for(long j = 0; j < k; j++) {
+                const double logp = z[j] / m_Temperature - m - std::log(sum);
+                loss -= scale * m_Temperature * m_Temperature * target(j) * logp;
+                g[i * k + j] = scale * m_Temperature * (std::exp(logp) - target(j));
+            }
+        }
+        return loss;
+    }
+
+    friend void serialize(const loss_distill_& item, std::ostream& out) {
+        dlib::serialize("loss_distill_", out);
+        dlib::serialize(item.m_Temperature, out);
+    }
+
+    friend void deserialize(loss_distill_& item, std::istream& in) {
+        std::string version;
+        dlib::deserialize(version, in);
+        if(version != "loss_distill_")
+            throw dlib::serialization_error("Unexpected version found while deserializing loss_distill_.");
+        dlib::deserialize(item.m_Temperature, in);
+    }
+
+    friend std::ostream& operator<<(std::ostream& out, const loss_distill_& item) {
+        out << "loss_distill (temperature=" << item.m_Temperature << ")";
+        return out;
+    }
+
+    friend void to_xml(const loss_distill_& item, std::ostream& out) {
+        out << "<loss_distill temperature='" << item.m_Temperature << "'/>";
+    }
+
+private:
+    float m_Temperature;
+};
+
+template<typename SUBNET>
+using loss_distill = dlib::add_loss_layer<loss_distill_, SUBNET>;
+
+#endif // DISTILLLOSS_H
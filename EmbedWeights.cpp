@@ -0,0 +1,67 @@
+/**
+ * @file EmbedWeights.cpp
+ * @brief Host tool of make embed, writes weight files as C++ arrays to a header.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+/**
+ * Usage: embed_weights <header> <array>=<file>...
+ * Every file becomes a 64 byte aligned array named <array>, as expected by LeNetWeightFile.cpp.
+ * The header is written to a temporary file first, a failed run leaves the previous header in place.
+ */
+int main(int argc, char** argv)
+{
+    if(argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " <header> <array>=<file>..." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const std::string header = argv[1];
+    const std::string tmp = header + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        out << "// generated by make embed, do not edit\n";
+        for(int i = 2; i < argc; i++) {
+            const std::string arg = argv[i];
+            const size_t sep = arg.find('=');
+            if(sep == std::string::npos || sep == 0) {
+                std::cerr << "Expected <array>=<file>: " << arg << std::endl;
+                return EXIT_FAILURE;
+            }
+            const std::string file = arg.substr(sep + 1);
+            std::ifstream in(file, std::ios::binary);
+            std::vector<unsigned char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            if(!in || data.empty()) {
+                std::cerr << "Unable to read " << file << std::endl;
+                return EXIT_FAILURE;
+            }
+
+            out << "// " << file << "\n";
+            out << "alignas(64) static const unsigned char " << arg.substr(0, sep) << "[] = {";
+            for(size_t b = 0; b < data.size(); b++)
+                out << (b % 16 == 0 ? "\n    " : " ") << static_cast<unsigned>(data[b]) << ",";
+            out << "\n};\n";
+        }
+        if(!out) {
+            std::cerr << "Unable to write " << tmp << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    if(std::rename(tmp.c_str(), header.c_str()) != 0) {
+        std::remove(tmp.c_str());
+        std::cerr << "Unable to replace " << header << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
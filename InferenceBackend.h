@@ -0,0 +1,220 @@
+/**
+ * @file InferenceBackend.h
+ * @brief Interface of the inference engines classifying digits, and its implementations.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#ifndef INFERENCEBACKEND_H
+#define INFERENCEBACKEND_H
+
+#include <Object.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <dlib/dnn.h>
+#include "NetworkPool.h"
+#include "LeNetEngine.h"
+#include "LeNetInt8.h"
+#include "LeNetPruned.h"
+#include "LeNetGemm.h"
+
+/**
+ * @brief Classifies batches of 28x28 digits, implemented by every inference engine.
+ * Implementations need to be thread safe, classify() is called concurrently by the worker threads.
+ */
+class InferenceBackend : public giri::Object<InferenceBackend>
+{
+public:
+    using Digits = std::vector<dlib::matrix<unsigned char>>;
+    using Probabilities = std::vector<dlib::matrix<float, 1, 10>>;
+
+    /**
+     * @brief Usage statistics of the network replicas of a backend.
+     */
+    struct ReplicaStats
+    {
+        size_t replicas = 0;
+        unsigned long long checkouts = 0;
+        unsigned long long waits = 0;
+    };
+
+    virtual ~InferenceBackend() = default;
+
+    /**
+     * @returns Name of the backend as selected by the engine option.
+     */
+    virtual std::string name() const = 0;
+
+    /**
+     * @brief Classifies all digits.
+     * @param digits 28x28 images of the digits to classify.
+     * @returns Label probabilities for every digit, in the same order as digits.
+     */
+    virtual Probabilities classify(const Digits& digits) = 0;
+
+    /**
+     * @brief Classifies digits of optional work (the variants of voting requests), which must never delay
+     * classify(). Backends sharing network replicas between threads use replicas of their own for it.
+     * @param digits 28x28 images of the digits to classify.
+     * @returns Label probabilities for every digit, in the same order as digits.
+     */
+    virtual Probabilities classifyBackground(const Digits& digits) { return classify(digits); }
+
+    /**
+     * @returns Usage statistics of the replicas, backends without replicas report none (replicas = 0).
+     */
+    virtual ReplicaStats replicaStats() const { return ReplicaStats(); }
+};
+
+/**
+ * @brief Backend running a dlib network with a softmax output layer, the reference implementation.
+ * @tparam Net dlib network type, one replica is created per worker thread (see NetworkPool),
+ * and as many for classifyBackground().
+ */
+template<typename Net>
+class DlibBackend final : public InferenceBackend
+{
+public:
+    /**
+     * @param name Name of the backend.
+     * @param prototype Network to copy into the replicas.
+     * @param replicas Number of replicas, should match the number of worker threads.
+     * @param batchSize Maximum number of digits pushed through the network at once.
+     */
+    DlibBackend(const std::string& name, const Net& prototype, size_t replicas, size_t batchSize) : m_Name(name), m_BatchSize(batchSize) {
+        m_Pool.reset(prototype, replicas);
+        m_BackgroundPool.reset(prototype, replicas);
+    }
+
+    std::string name() const override { return m_Name; }
+
+    Probabilities classify(const Digits& digits) override {
+        return classify(m_Pool, digits);
+    }
+
+    Probabilities classifyBackground(const Digits& digits) override {
+        return classify(m_BackgroundPool, digits);
+    }
+
+    ReplicaStats replicaStats() const override {
+        ReplicaStats stats;
+        stats.replicas = m_Pool.size();
+        stats.checkouts = m_Pool.checkouts();
+        stats.waits = m_Pool.waits();
+        return stats;
+    }
+
+    /**
+     * @returns Pool of network replicas, gives access to the layer outputs and usage statistics.
+     */
+    NetworkPool<Net>& pool() { return m_Pool; }
+    const NetworkPool<Net>& pool() const { return m_Pool; }
+
+private:
+    Probabilities classify(NetworkPool<Net>& pool, const Digits& digits) {
+        Probabilities probs;
+        probs.reserve(digits.size());
+
+        // network replica exclusively used by this thread
+        auto net = pool.checkout();
+
+        // push all digits through the network in batches of at most m_BatchSize,
+        // every row of the output tensor holds the probabilities of one digit
+        for(size_t first = 0; first < digits.size(); first += m_BatchSize) {
+            size_t last = std::min(first + m_BatchSize, digits.size());
+            dlib::matrix<float> p = dlib::mat((*net)(digits.begin() + first, digits.begin() + last));
+            for(long r = 0; r < p.nr(); r++)
+                probs.emplace_back(dlib::rowm(p, r));
+        }
+        return probs;
+    }
+
+    std::string m_Name;
+    size_t m_BatchSize;
+    NetworkPool<Net> m_Pool;
+    NetworkPool<Net> m_BackgroundPool; // replicas of classifyBackground(), regular passes never wait for them
+};
+
+/**
+ * @brief Backend running the LeNet specialized at compile time (see LeNetEngine.h), batches
+ * large enough for im2col + sgemm to be faster on this machine use that path (see LeNetGemm.h).
+ */
+class StaticBackend final : public InferenceBackend
+{
+public:
+    /**
+     * @param weights Network weights.
+     * @param batchSize Maximum number of digits usually classified at once, included in the sgemm calibration.
+     */
+    StaticBackend(std::shared_ptr<const lenet::Weights> weights, size_t batchSize) : 
+        m_Weights(std::move(weights)), m_GemmMinBatch(lenet::gemmMinBatch(batchSize)) {}
+
+    std::string name() const override { return "static"; }
+
+    Probabilities classify(const Digits& digits) override {
+        // the engine only reads the shared weights, no replica needed
+        std::vector<const unsigned char*> imgs;
+        for(auto const& curDigit : digits)
+            imgs.push_back(&curDigit(0, 0));
+        std::vector<float> p(digits.size() * lenet::Labels);
+        if(imgs.size() >= m_GemmMinBatch)
+            lenet::predictGemm(*m_Weights, imgs.data(), imgs.size(), p.data());
+        else
+            lenet::predict(*m_Weights, imgs.data(), imgs.size(), p.data());
+        Probabilities probs(digits.size());
+        for(size_t i = 0; i < digits.size(); i++)
+            std::copy(p.begin() + i * lenet::Labels, p.begin() + (i + 1) * lenet::Labels, &probs[i](0));
+        return probs;
+    }
+
+private:
+    std::shared_ptr<const lenet::Weights> m_Weights;
+    size_t m_GemmMinBatch; // measured once per process, when the first static backend is created
+};
+
+/**
+ * @brief Backend running the INT8 quantized LeNet (see LeNetInt8.h).
+ */
+class Int8Backend final : public InferenceBackend
+{
+public:
+    Int8Backend(std::shared_ptr<const lenet::int8::Weights> weights) : m_Weights(std::move(weights)) {}
+
+    std::string name() const override { return "int8"; }
+
+    Probabilities classify(const Digits& digits) override {
+        Probabilities probs(digits.size());
+        for(size_t i = 0; i < digits.size(); i++)
+            lenet::int8::predict(*m_Weights, &digits[i](0, 0), &probs[i](0));
+        return probs;
+    }
+
+private:
+    std::shared_ptr<const lenet::int8::Weights> m_Weights;
+};
+
+/**
+ * @brief Backend running the pruned LeNet (see LeNetPruned.h).
+ */
+class PrunedBackend final : public InferenceBackend
+{
+public:
+    PrunedBackend(std::shared_ptr<const lenet::pruned::Weights> weights) : m_Weights(std::move(weights)) {}
+
+    std::string name() const override { return "pruned"; }
+
+    Probabilities classify(const Digits& digits) override {
+        Probabilities probs(digits.size());
+        for(size_t i = 0; i < digits.size(); i++)
+            lenet::pruned::predict(*m_Weights, &digits[i](0, 0), &probs[i](0));
+        return probs;
+    }
+
+private:
+    std::shared_ptr<const lenet::pruned::Weights> m_Weights;
+};
+
+#endif // INFERENCEBACKEND_H
@@ -0,0 +1,133 @@
+/**
+ * @file LeNetBitConv.h
+ * @brief First LeNet convolution computed on bit packed, (mostly) binary input images.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#ifndef LENETBITCONV_H
+#define LENETBITCONV_H
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+
+namespace lenet
+{
+    template<size_t InC, size_t OutC, size_t K>
+    struct ConvLayer;
+
+    /**
+     * @brief First convolution layer (one input channel) for binarized input images,
+     * fused with relu and 2x2 max pooling like ConvLayer.
+     *
+     * Digits are cut from a thresholded image, so almost all pixels are either 0 or 255.
+     * Only the edges contain a few gray pixels caused by downscaling the digits to 20x20.
+     * Every input pixel is split into a 255 bit (x == 255) and a gray residual (0 < x < 255).
+     *
+     * The 255 bits of each padded input row are packed into one integer. For every filter
+     * row a lookup table holds the weight sums of all 2^K bit patterns (scaled by 255) for
+     * all filters, so the binary part of one output position needs K table lookups
+     * instead of K x K multiply-adds per filter. The few gray pixels are added on top
+     * using the regular filter weights. The result is exact for any input image.
+     */
+    template<size_t OutC, size_t K>
+    struct BitConvLayer
+    {
+        static_assert(K <= 8, "Lookup tables are limited to filters up to 8 pixels wide.");
+        static constexpr size_t OutStride = (OutC + 7) / 8 * 8;
+        static constexpr size_t Patterns = size_t(1) << K;
+
+        // lut[ky][pattern][o]: 255 * sum of filters[o][ky][kx] over all bits kx set in pattern
+        alignas(64) float lut[K][Patterns][OutStride];
+        alignas(64) float filters[K][K][OutStride];
+        alignas(64) float biases[OutStride];
+
+        /**
+         * @brief Builds the lookup tables from a regular convolution layer.
+         */
+        void load(const ConvLayer<1, OutC, K>& l) {
+            std::copy(&l.filters[0][0][0][0], &l.filters[0][0][0][0] + K * K * OutStride, &filters[0][0][0]);
+            std::copy(l.biases, l.biases + OutStride, biases);
+            for(size_t ky = 0; ky < K; ky++)
+                for(size_t p = 0; p < Patterns; p++)
+                    for(size_t o = 0; o < OutStride; o++) {
+                        float sum = 0;
+                        for(size_t kx = 0; kx < K; kx++)
+                            if(p & (size_t(1) << kx))
+                                sum += filters[ky][kx][o];
+                        lut[ky][p][o] = 255.0f * sum;
+                    }
+        }
+
+        /**
+         * @brief Computes convolution (zero padding of K/2 pixels), relu and max pooling in one pass.
+         * @tparam H Input height (even).
+         * @tparam W Input width (even).
+         * @param img Grayscale image (H x W, row major).
+         * @param out Output tensor (H/2 x W/2 x OutStride), padding channels are set to 0.
+         */
+        template<size_t H, size_t W>
+        void forward(const unsigned char* img, float* out) const {
+            static_assert(W + K - 1 <= 64, "Padded image rows need to fit into 64 bits.");
+            constexpr size_t P = K / 2;
+            constexpr size_t PH = H + K - 1;
+            constexpr uint64_t Mask = Patterns - 1;
+
+            // bit x + P of row y + P is set if the pixel (x, y) is 255 (ones) or gray (gray)
+            uint64_t ones[PH] = {};
+            uint64_t gray[PH] = {};
+            for(size_t y = 0; y < H; y++)
+                for(size_t x = 0; x < W; x++) {
+                    const unsigned char v = img[y * W + x];
+                    ones[y + P] |= uint64_t(v == 255) << (x + P);
+                    gray[y + P] |= uint64_t(v != 0 && v != 255) << (x + P);
+                }
+
+            for(size_t py = 0; py < H / 2; py++)
+                for(size_t px = 0; px < W / 2; px++) {
+                    float acc[4][OutStride] = {};
+                    for(size_t d = 0; d < 4; d++) {
+                        const size_t y = 2 * py + d / 2;
+                        const size_t x = 2 * px + d % 2;
+
+                        // binary part, one table lookup per filter row
+                        for(size_t ky = 0; ky < K; ky++) {
+                            const float* l = lut[ky][(ones[y + ky] >> x) & Mask];
+                            for(size_t o = 0; o < OutStride; o++)
+                                acc[d][o] += l[o];
+                        }
+
+                        // gray residual
+                        for(size_t ky = 0; ky < K; ky++)
+                            for(uint64_t g = (gray[y + ky] >> x) & Mask; g; g &= g - 1) {
+                                const size_t kx = ctz(g);
+                                const float v = img[(y + ky - P) * W + x + kx - P];
+                                for(size_t o = 0; o < OutStride; o++)
+                                    acc[d][o] += v * filters[ky][kx][o];
+                            }
+                    }
+                    float* dst = out + (py * (W / 2) + px) * OutStride;
+                    for(size_t o = 0; o < OutStride; o++) {
+                        float m = std::max(std::max(acc[0][o], acc[1][o]), std::max(acc[2][o], acc[3][o]));
+                        dst[o] = std::max(m + biases[o], 0.0f);
+                    }
+                }
+        }
+
+    private:
+        static size_t ctz(uint64_t v) {
+        #if defined(__GNUC__)
+            return __builtin_ctzll(v);
+        #else
+            size_t n = 0;
+            while(!(v & 1)) { v >>= 1; n++; }
+            return n;
+        #endif
+        }
+    };
+}
+
+#endif // LENETBITCONV_H
@@ -0,0 +1,281 @@
+/**
+ * @file LeNetEngine.h
+ * @brief Inference engine specialized for the fixed shapes of MNISTLeNet::LeNet.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#ifndef LENETENGINE_H
+#define LENETENGINE_H
+
+#include <cstddef>
+#include <cmath>
+#include <algorithm>
+#include "LeNetKernels.h"
+#include "LeNetBitConv.h"
+
+/**
+ * @brief Inference engine specialized for the fixed shapes of MNISTLeNet::LeNet.
+ *
+ * All layer shapes are template parameters, so every loop bound is a compile time
+ * constant and all intermediate buffers are statically sized and live on the stack.
+ * Each convolution is fused with the following relu and max pooling (see LeNetKernels.h),
+ * activations are stored channels last. Without SIMD kernels the first convolution runs
+ * on the bit packed input image instead (see LeNetBitConv.h).
+ * The engine does not allocate any memory during inference and the weights are
+ * only read, so one set of weights can be shared by all threads.
+ *
+ * Network layout (dlib pads 5x5 convolutions with stride 1 by 2 pixels):
+ * 1x28x28 -> con 6x28x28 -> relu, max_pool 6x14x14
+ *         -> con 16x14x14 -> relu, max_pool 16x7x7
+ *         -> fc 120 -> relu -> fc 84 -> relu -> fc 10 -> softmax
+ */
+namespace lenet
+{
+    /**
+     * @brief Convolution layer with stride 1 and zero padding of K/2 pixels, followed by relu and 2x2 max pooling.
+     * @tparam InC Number of input channels.
+     * @tparam OutC Number of filters.
+     * @tparam K Filter size (KxK).
+     */
+    template<size_t InC, size_t OutC, size_t K>
+    struct ConvLayer
+    {
+        static constexpr size_t NumParams = OutC * InC * K * K + OutC;
+
+        // output channels are padded to whole SIMD vectors (8 floats)
+        static constexpr size_t OutStride = (OutC + 7) / 8 * 8;
+
+        // stored as InC x K x K x OutStride, the values of all filters for one tap are contiguous
+        alignas(64) float filters[InC][K][K][OutStride];
+        alignas(64) float biases[OutStride];
+
+        /**
+         * @brief Loads the parameters of a dlib con_ layer.
+         * @param params dlib layer parameters, all filters (OutC x InC x K x K) followed by the biases.
+         */
+        void load(const float* params) {
+            std::fill(&filters[0][0][0][0], &filters[0][0][0][0] + InC * K * K * OutStride, 0.0f);
+            std::fill(biases, biases + OutStride, 0.0f);
+            for(size_t o = 0; o < OutC; o++)
+                for(size_t c = 0; c < InC; c++)
+                    for(size_t ky = 0; ky < K; ky++)
+                        for(size_t kx = 0; kx < K; kx++)
+                            filters[c][ky][kx][o] = params[((o * InC + c) * K + ky) * K + kx];
+            std::copy(params + OutC * InC * K * K, params + NumParams, biases);
+        }
+
+        /**
+         * @brief Computes convolution, relu and max pooling in one pass.
+         * @tparam H Input height (even).
+         * @tparam W Input width (even).
+         * @tparam InStride Distance between two pixels of the input (>= InC).
+         * @param in Input tensor (H x W x InStride).
+         * @param out Output tensor (H/2 x W/2 x OutStride), padding channels are set to 0.
+         */
+        template<size_t H, size_t W, size_t InStride>
+        void forward(const float* in, float* out) const {
+            static_assert(H % 2 == 0 && W % 2 == 0, "Pooling expects even input sizes.");
+            constexpr size_t P = K / 2;
+            constexpr size_t PH = H + K - 1;
+            constexpr size_t PW = W + K - 1;
+
+            // zero padded copy of the input, avoids bounds checks within the kernels
+            alignas(64) float padded[PH * PW * InStride] = {};
+            for(size_t y = 0; y < H; y++)
+                std::copy(in + y * W * InStride, in + (y + 1) * W * InStride, padded + ((y + P) * PW + P) * InStride);
+
+            kernels::convReluPool<InC, InStride, OutStride, K, H, W>(padded, &filters[0][0][0][0], biases, out);
+        }
+    };
+
+    /**
+     * @brief Fully connected layer.
+     * @tparam In Number of inputs.
+     * @tparam Out Number of outputs.
+     */
+    template<size_t In, size_t Out>
+    struct FcLayer
+    {
+        static constexpr size_t NumParams = In * Out + Out;
+
+        // input and output vectors are padded to whole SIMD vectors (8 floats)
+        static constexpr size_t InStride = (In + 7) / 8 * 8;
+        static constexpr size_t OutStride = (Out + 7) / 8 * 8;
+
+        // stored transposed to dlib (one row per output), dot products read contiguous memory
+        alignas(64) float weights[Out][InStride];
+        alignas(64) float biases[Out];
+
+        /**
+         * @brief Loads the parameters of a dlib fc_ layer.
+         * @param params dlib layer parameters, weight matrix (In x Out) followed by the biases.
+         */
+        void load(const float* params) {
+            std::fill(&weights[0][0], &weights[0][0] + Out * InStride, 0.0f);
+            for(size_t i = 0; i < In; i++)
+                for(size_t o = 0; o < Out; o++)
+                    weights[o][i] = params[i * Out + o];
+            std::copy(params + In * Out, params + NumParams, biases);
+        }
+
+        /**
+         * @brief Loads the parameters of a dlib fc_ layer whose input is a C x H x W tensor
+         * that is stored channels last (H x W x C) by this engine.
+         * @param params dlib layer parameters, weight matrix (In x Out) followed by the biases.
+         */
+        template<size_t C, size_t H, size_t W>
+        void loadChannelsLast(const float* params) {
+            static_assert(C * H * W == In, "Input shape does not match the layer.");
+            std::fill(&weights[0][0], &weights[0][0] + Out * InStride, 0.0f);
+            for(size_t c = 0; c < C; c++)
+                for(size_t i = 0; i < H * W; i++)
+                    for(size_t o = 0; o < Out; o++)
+                        weights[o][i * C + c] = params[(c * H * W + i) * Out + o];
+            std::copy(params + In * Out, params + NumParams, biases);
+        }
+
+        /**
+         * @brief Computes the layer output for a tile of input vectors.
+         * @tparam Tile Number of input vectors.
+         * @tparam Relu Apply relu to the output.
+         * @param in Input vectors (Tile x InStride).
+         * @param out Output vectors (Tile x OutStride).
+         */
+        template<size_t Tile, bool Relu>
+        void forward(const float* in, float* out) const {
+            kernels::fc<InStride, Out, OutStride, Tile, Relu>(&weights[0][0], biases, in, out);
+        }
+    };
+
+    /**
+     * @brief Converts the network outputs to label probabilities.
+     * @tparam N Number of labels.
+     * @param inout Network outputs, replaced by the probabilities.
+     */
+    template<size_t N>
+    void softmax(float* inout) {
+        float m = *std::max_element(inout, inout + N);
+        float sum = 0;
+        for(size_t i = 0; i < N; i++) {
+            inout[i] = std::exp(inout[i] - m);
+            sum += inout[i];
+        }
+        for(size_t i = 0; i < N; i++)
+            inout[i] /= sum;
+    }
+
+    // shapes of MNISTLeNet::LeNet
+    constexpr size_t ImgSize = 28;
+    constexpr size_t Conv1Filters = 6;
+    constexpr size_t Conv2Filters = 16;
+    constexpr size_t FilterSize = 5;
+    constexpr size_t Pool1Size = ImgSize / 2;
+    constexpr size_t Pool2Size = Pool1Size / 2;
+    constexpr size_t Features = Conv2Filters * Pool2Size * Pool2Size;
+    constexpr size_t Fc1Outputs = 120;
+    constexpr size_t Fc2Outputs = 84;
+    constexpr size_t Labels = 10;
+
+    /**
+     * @brief All weights of MNISTLeNet::LeNet.
+     */
+    struct Weights
+    {
+        ConvLayer<1, Conv1Filters, FilterSize> conv1;
+        BitConvLayer<Conv1Filters, FilterSize> conv1Bits; // built from conv1 after loading
+        ConvLayer<Conv1Filters, Conv2Filters, FilterSize> conv2;
+        FcLayer<Features, Fc1Outputs> fc1;
+        FcLayer<Fc1Outputs, Fc2Outputs> fc2;
+        FcLayer<Fc2Outputs, Labels> fc3;
+    };
+
+    /**
+     * @brief Computes the conv stages of one digit.
+     * @param w Network weights.
+     * @param img 28x28 grayscale image (row major).
+     * @param features [out] Input of the fully connected layers (Features).
+     */
+    inline void features(const Weights& w, const unsigned char* img, float* features) {
+        using Conv1 = decltype(w.conv1);
+        using Conv2 = decltype(w.conv2);
+        static_assert(Conv2::OutStride == Conv2Filters, "fc1 expects unpadded conv2 output.");
+
+        alignas(64) float in[ImgSize * ImgSize];
+        alignas(64) float pool1[Pool1Size * Pool1Size * Conv1::OutStride];
+
+        // the bit packed convolution only beats the dense one if the latter is not vectorized
+        if(kernels::vectorized()) {
+            std::copy(img, img + ImgSize * ImgSize, in);
+            w.conv1.forward<ImgSize, ImgSize, 1>(in, pool1);
+        }
+        else
+            w.conv1Bits.forward<ImgSize, ImgSize>(img, pool1);
+        w.conv2.forward<Pool1Size, Pool1Size, Conv1::OutStride>(pool1, features);
+    }
+
+    // digits per tile of the fully connected chain
+    constexpr size_t FcTile = 4;
+
+    /**
+     * @brief Computes the fully connected chain (fc 120, relu, fc 84, relu, fc 10, softmax) 
+     * for a tile of digits in one pass, all intermediate vectors stay on the stack.
+     * @param w Network weights.
+     * @param features Features of FcTile digits (FcTile x Features).
+     * @param probs [out] Label probabilities (FcTile x Labels).
+     */
+    inline void fcChain(const Weights& w, const float* features, float* probs) {
+        using Fc1 = decltype(w.fc1);
+        using Fc2 = decltype(w.fc2);
+        using Fc3 = decltype(w.fc3);
+        static_assert(Fc1::InStride == Features, "fc1 expects unpadded features.");
+
+        alignas(64) float fc1[FcTile * Fc1::OutStride];
+        alignas(64) float fc2[FcTile * Fc2::OutStride];
+        alignas(64) float fc3[FcTile * Fc3::OutStride];
+
+        w.fc1.forward<FcTile, true>(features, fc1);
+        w.fc2.forward<FcTile, true>(fc1, fc2);
+        w.fc3.forward<FcTile, false>(fc2, fc3);
+        for(size_t t = 0; t < FcTile; t++) {
+            std::copy(fc3 + t * Fc3::OutStride, fc3 + t * Fc3::OutStride + Labels, probs + t * Labels);
+            softmax<Labels>(probs + t * Labels);
+        }
+    }
+
+    /**
+     * @brief Classifies a batch of digits. The digits are processed in tiles of FcTile,
+     * so the weights of the fully connected layers are read once per tile.
+     * @param w Network weights.
+     * @param imgs 28x28 grayscale images (row major).
+     * @param n Number of images.
+     * @param probs [out] Label probabilities (n x Labels).
+     */
+    inline void predict(const Weights& w, const unsigned char* const* imgs, size_t n, float* probs) {
+        alignas(64) float feats[FcTile * Features];
+        alignas(64) float tileProbs[FcTile * Labels];
+        for(size_t first = 0; first < n; first += FcTile) {
+            const size_t count = std::min(FcTile, n - first);
+            for(size_t t = 0; t < count; t++)
+                features(w, imgs[first + t], feats + t * Features);
+            // unused slots of the last tile
+            std::fill(feats + count * Features, feats + FcTile * Features, 0.0f);
+            fcChain(w, feats, tileProbs);
+            std::copy(tileProbs, tileProbs + count * Labels, probs + first * Labels);
+        }
+    }
+
+    /**
+     * @brief Classifies one digit.
+     * @param w Network weights.
+     * @param img 28x28 grayscale image (row major).
+     * @param probs [out] Label probabilities.
+     */
+    inline void predict(const Weights& w, const unsigned char* img, float* probs) {
+        predict(w, &img, 1, probs);
+    }
+}
+
+#endif // LENETENGINE_H
@@ -0,0 +1,139 @@
+/**
+ * @file LeNetGemm.cpp
+ * @brief Batched LeNet inference using im2col and the linked CBLAS.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#include "LeNetGemm.h"
+#include <vector>
+#include <chrono>
+#include <memory>
+#include <limits>
+#include <iterator>
+#include <algorithm>
+#include <cblas.h>
+
+namespace lenet
+{
+namespace
+{
+    /**
+     * @brief Convolution (stride 1, zero padding K/2) of a block of images as im2col + sgemm,
+     * followed by bias, relu and 2x2 max pooling.
+     * @param in Input tensors (n x H x W x InStride).
+     * @param n Number of images.
+     * @param out Output tensors (n x H/2 x W/2 x OutStride).
+     */
+    template<size_t InC, size_t OutC, size_t K, size_t H, size_t W, size_t InStride>
+    void convGemm(const ConvLayer<InC, OutC, K>& l, const float* in, size_t n, float* out, 
+                  std::vector<float>& cols, std::vector<float>& res) {
+        constexpr size_t P = K / 2;
+        constexpr size_t Taps = InC * K * K;
+        constexpr size_t OutStride = ConvLayer<InC, OutC, K>::OutStride;
+
+        // one row per output position, columns ordered like the filters (c, ky, kx)
+        cols.assign(n * H * W * Taps, 0.0f);
+        for(size_t i = 0; i < n; i++)
+            for(size_t y = 0; y < H; y++)
+                for(size_t x = 0; x < W; x++) {
+                    float* row = cols.data() + ((i * H + y) * W + x) * Taps;
+                    for(size_t ky = 0; ky < K; ky++) {
+                        if(y + ky < P || y + ky - P >= H) continue;
+                        for(size_t kx = 0; kx < K; kx++) {
+                            if(x + kx < P || x + kx - P >= W) continue;
+                            const float* src = in + ((i * H + y + ky - P) * W + x + kx - P) * InStride;
+                            for(size_t c = 0; c < InC; c++)
+                                row[(c * K + ky) * K + kx] = src[c];
+                        }
+                    }
+                }
+
+        // (n*H*W x Taps) * (Taps x OutStride), the filters are stored as InC x K x K x OutStride
+        res.resize(n * H * W * OutStride);
+        cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, n * H * W, OutStride, Taps,
+                    1.0f, cols.data(), Taps, &l.filters[0][0][0][0], OutStride, 0.0f, res.data(), OutStride);
+
+        for(size_t i = 0; i < n; i++)
+            for(size_t py = 0; py < H / 2; py++)
+                for(size_t px = 0; px < W / 2; px++) {
+                    const float* r = res.data() + ((i * H + 2 * py) * W + 2 * px) * OutStride;
+                    float* dst = out + ((i * (H / 2) + py) * (W / 2) + px) * OutStride;
+                    for(size_t o = 0; o < OutStride; o++) {
+                        float m = std::max(std::max(r[o], r[OutStride + o]), std::max(r[W * OutStride + o], r[(W + 1) * OutStride + o]));
+                        dst[o] = std::max(m + l.biases[o], 0.0f);
+                    }
+                }
+    }
+}
+
+void predictGemm(const Weights& w, const unsigned char* const* imgs, size_t n, float* probs) {
+    using Conv1 = decltype(w.conv1);
+    std::vector<float> in, pool1, feats, cols, res;
+    alignas(64) float tileFeats[FcTile * Features];
+    alignas(64) float tileProbs[FcTile * Labels];
+
+    for(size_t first = 0; first < n; first += GemmBlock) {
+        const size_t count = std::min(GemmBlock, n - first);
+
+        in.resize(count * ImgSize * ImgSize);
+        for(size_t i = 0; i < count; i++)
+            std::copy(imgs[first + i], imgs[first + i] + ImgSize * ImgSize, in.begin() + i * ImgSize * ImgSize);
+
+        pool1.resize(count * Pool1Size * Pool1Size * Conv1::OutStride);
+        feats.resize(count * Features);
+        convGemm<1, Conv1Filters, FilterSize, ImgSize, ImgSize, 1>(w.conv1, in.data(), count, pool1.data(), cols, res);
+        convGemm<Conv1Filters, Conv2Filters, FilterSize, Pool1Size, Pool1Size, Conv1::OutStride>(w.conv2, pool1.data(), count, feats.data(), cols, res);
+
+        for(size_t t0 = 0; t0 < count; t0 += FcTile) {
+            const size_t tile = std::min(FcTile, count - t0);
+            std::fill(tileFeats, tileFeats + FcTile * Features, 0.0f);
+            std::copy(feats.begin() + t0 * Features, feats.begin() + (t0 + tile) * Features, tileFeats);
+            fcChain(w, tileFeats, tileProbs);
+            std::copy(tileProbs, tileProbs + tile * Labels, probs + (first + t0) * Labels);
+        }
+    }
+}
+
+size_t gemmMinBatch(size_t batchSize) {
+    static const size_t minBatch = [batchSize]() {
+        // measured in ascending order, the batch size the engine is called with is always included
+        std::vector<size_t> sizes(std::begin(GemmCalibrationBatches), std::end(GemmCalibrationBatches));
+        if(batchSize > 0)
+            sizes.push_back(batchSize);
+        std::sort(sizes.begin(), sizes.end());
+        sizes.erase(std::unique(sizes.begin(), sizes.end()), sizes.end());
+
+        // timing does not depend on the weights, all zero weights avoid waiting for the trained ones
+        auto w = std::make_unique<Weights>();
+        std::vector<unsigned char> digits(sizes.back() * ImgSize * ImgSize, 0);
+        for(size_t i = 0; i < digits.size(); i += 3)
+            digits[i] = 255;
+        std::vector<const unsigned char*> imgs;
+        for(size_t i = 0; i < sizes.back(); i++)
+            imgs.push_back(digits.data() + i * ImgSize * ImgSize);
+        std::vector<float> probs(imgs.size() * Labels);
+
+        // best of two runs, the first one also warms up caches and the BLAS threads
+        auto fastest = [&](auto run) {
+            double best = std::numeric_limits<double>::max();
+            for(int i = 0; i < 2; i++) {
+                auto start = std::chrono::steady_clock::now();
+                run();
+                best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+            }
+            return best;
+        };
+        for(size_t n : sizes) {
+            double direct = fastest([&]() { predict(*w, imgs.data(), n, probs.data()); });
+            double gemm = fastest([&]() { predictGemm(*w, imgs.data(), n, probs.data()); });
+            if(gemm < direct)
+                return n;
+        }
+        return std::numeric_limits<size_t>::max();
+    }();
+    return minBatch;
+}
+}
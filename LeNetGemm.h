@@ -0,0 +1,46 @@
+/**
+ * @file LeNetGemm.h
+ * @brief Batched LeNet inference using im2col and the linked CBLAS.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#ifndef LENETGEMM_H
+#define LENETGEMM_H
+
+#include "LeNetEngine.h"
+
+namespace lenet
+{
+    // digits per im2col block, bounds the size of the im2col matrices (about 7.5 MB for conv2)
+    constexpr size_t GemmBlock = 64;
+
+    // batch sizes predictGemm is timed at against the direct kernels, see gemmMinBatch
+    constexpr size_t GemmCalibrationBatches[] = { GemmBlock, 4 * GemmBlock };
+
+    /**
+     * @brief Classifies a batch of digits. Both convolutions are computed for a whole
+     * block of digits as im2col followed by a single cblas_sgemm, the fully connected
+     * chain uses the same tiled kernel as predict.
+     * @param w Network weights.
+     * @param imgs 28x28 grayscale images (row major).
+     * @param n Number of images.
+     * @param probs [out] Label probabilities (n x Labels).
+     * @note Implemented in LeNetGemm.cpp, which keeps cblas.h away from the dlib headers.
+     */
+    void predictGemm(const Weights& w, const unsigned char* const* imgs, size_t n, float* probs);
+
+    /**
+     * @brief Smallest batch size predictGemm is faster than the direct kernels at on this machine.
+     * Both paths are timed on synthetic digits at the GemmCalibrationBatches sizes and at batchSize on the
+     * first call (about 0.1 s), later calls return the cached result. Beyond the largest size the cost per digit
+     * no longer changes, as predictGemm works on blocks of GemmBlock digits.
+     * @param batchSize Batch size the engine is usually called with, only used by the first call.
+     * @returns Batch size from which on predictGemm is faster, SIZE_MAX if the direct kernels won at all sizes.
+     */
+    size_t gemmMinBatch(size_t batchSize);
+}
+
+#endif // LENETGEMM_H
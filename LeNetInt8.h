@@ -0,0 +1,271 @@
+/**
+ * @file LeNetInt8.h
+ * @brief INT8 quantized version of the LeNet inference engine.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#ifndef LENETINT8_H
+#define LENETINT8_H
+
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include "LeNetEngine.h"
+
+/**
+ * @brief INT8 quantized version of the LeNet inference engine.
+ *
+ * Weights are quantized symmetrically per output channel (int8), activations are
+ * non negative after relu and quantized per tensor (uint8) using the maximum values
+ * observed during calibration. Input pixels are used as they are (scale 1).
+ *
+ * Convolutions and fully connected layers are computed as dot products of uint8
+ * activations and int8 weights accumulated in int32.
+ * Requantization to the uint8 input of the next layer uses a fixed point multiplier
+ * and shift per output channel, so all hidden layers run on the integer unit. Only the
+ * output layer is dequantized to float (one multiplication per label) before the softmax.
+ * This keeps the engine fast on targets with a weak or no FPU.
+ */
+namespace lenet
+{
+    /**
+     * @brief Maximum activations observed on the calibration data set.
+     */
+    struct Calibration
+    {
+        float pool1 = 0; ///< output of the first relu/max_pool
+        float pool2 = 0; ///< output of the second relu/max_pool
+        float fc1 = 0;   ///< output of the relu after fc 120
+        float fc2 = 0;   ///< output of the relu after fc 84
+    };
+
+    namespace int8
+    {
+        /**
+         * @brief Fixed point representation of a positive real multiplier (multiplier * 2^-shift).
+         */
+        struct Requantizer
+        {
+            int32_t multiplier = 0;
+            int32_t shift = 0;
+
+            void set(double real) {
+                if(real <= 0) { multiplier = 0; shift = 0; return; }
+                int exp;
+                double f = std::frexp(real, &exp); // real = f * 2^exp, f in [0.5, 1)
+                int64_t m = static_cast<int64_t>(std::llround(f * (1LL << 31)));
+                if(m == (1LL << 31)) { m /= 2; exp++; }
+                multiplier = static_cast<int32_t>(m);
+                shift = std::clamp(31 - exp, 1, 62);
+            }
+
+            /**
+             * @returns acc * real rounded and clamped to uint8, negative values become 0 (relu).
+             */
+            uint8_t apply(int32_t acc) const {
+                int64_t v = (static_cast<int64_t>(acc) * multiplier + (1LL << (shift - 1))) >> shift;
+                return static_cast<uint8_t>(std::clamp<int64_t>(v, 0, 255));
+            }
+        };
+
+        /**
+         * @brief Quantizes values symmetrically to int8.
+         * @returns The scale (real value of 1).
+         */
+        inline float quantize(const float* src, int8_t* dst, size_t count, size_t stride) {
+            float maxAbs = 0;
+            for(size_t i = 0; i < count; i++)
+                maxAbs = std::max(maxAbs, std::fabs(src[i * stride]));
+            float scale = maxAbs > 0 ? maxAbs / 127.0f : 1.0f;
+            for(size_t i = 0; i < count; i++)
+                dst[i * stride] = static_cast<int8_t>(std::lround(src[i * stride] / scale));
+            return scale;
+        }
+
+        /**
+         * @brief Dot product of uint8 activations and int8 weights.
+         */
+        template<size_t N>
+        inline int32_t dot(const uint8_t* a, const int8_t* b) {
+            int32_t sum = 0;
+            for(size_t i = 0; i < N; i++)
+                sum += static_cast<int32_t>(a[i]) * b[i];
+            return sum;
+        }
+
+        /**
+         * @brief Quantized convolution layer, fused with relu and 2x2 max pooling (see ConvLayer).
+         *
+         * Every filter is stored as one contiguous K x K x InStride vector and the input patch of
+         * every output position is gathered into a contiguous buffer, so the convolution becomes
+         * a series of integer dot products.
+         */
+        template<size_t InC, size_t OutC, size_t K, size_t InStride>
+        struct ConvLayer
+        {
+            static constexpr size_t OutStride = lenet::ConvLayer<InC, OutC, K>::OutStride;
+            static constexpr size_t PatchSize = K * K * InStride;
+
+            alignas(64) int8_t filters[OutStride][PatchSize];
+            alignas(64) int32_t biases[OutStride];
+            Requantizer requant[OutStride];
+
+            /**
+             * @brief Quantizes a float layer.
+             * @param l Float layer.
+             * @param inScale Scale of the input activations.
+             * @param outScale Scale of the output activations.
+             */
+            void quantize(const lenet::ConvLayer<InC, OutC, K>& l, float inScale, float outScale) {
+                static_assert(InStride >= InC, "Input stride is smaller than the number of channels.");
+                float taps[PatchSize];
+                for(size_t o = 0; o < OutStride; o++) {
+                    std::fill(taps, taps + PatchSize, 0.0f);
+                    for(size_t ky = 0; ky < K; ky++)
+                        for(size_t kx = 0; kx < K; kx++)
+                            for(size_t c = 0; c < InC; c++)
+                                taps[(ky * K + kx) * InStride + c] = l.filters[c][ky][kx][o];
+                    float scale = int8::quantize(taps, filters[o], PatchSize, 1);
+                    biases[o] = static_cast<int32_t>(std::lround(l.biases[o] / (inScale * scale)));
+                    requant[o].set(static_cast<double>(inScale) * scale / outScale);
+                }
+            }
+
+            /**
+             * @brief Computes convolution, relu and max pooling in one pass.
+             * @param in Input tensor (H x W x InStride).
+             * @param out Output tensor (H/2 x W/2 x OutStride).
+             */
+            template<size_t H, size_t W>
+            void forward(const uint8_t* in, uint8_t* out) const {
+                constexpr size_t P = K / 2;
+                constexpr size_t PH = H + K - 1;
+                constexpr size_t PW = W + K - 1;
+
+                alignas(64) uint8_t padded[PH * PW * InStride] = {};
+                for(size_t y = 0; y < H; y++)
+                    std::copy(in + y * W * InStride, in + (y + 1) * W * InStride, padded + ((y + P) * PW + P) * InStride);
+
+                for(size_t py = 0; py < H / 2; py++)
+                    for(size_t px = 0; px < W / 2; px++) {
+                        // input patches of the four positions reduced by the pooling
+                        alignas(64) uint8_t patch[4][PatchSize];
+                        for(size_t d = 0; d < 4; d++)
+                            for(size_t ky = 0; ky < K; ky++) {
+                                const uint8_t* src = padded + ((2 * py + d / 2 + ky) * PW + 2 * px + d % 2) * InStride;
+                                std::copy(src, src + K * InStride, patch[d] + ky * K * InStride);
+                            }
+
+                        // requantization is monotonic, so pooling can be done on the accumulators
+                        uint8_t* dst = out + (py * (W / 2) + px) * OutStride;
+                        for(size_t o = 0; o < OutStride; o++) {
+                            int32_t m = dot<PatchSize>(patch[0], filters[o]);
+                            for(size_t d = 1; d < 4; d++)
+                                m = std::max(m, dot<PatchSize>(patch[d], filters[o]));
+                            dst[o] = requant[o].apply(m + biases[o]);
+                        }
+                    }
+            }
+        };
+
+        /**
+         * @brief Quantized fully connected layer.
+         */
+        template<size_t In, size_t Out>
+        struct FcLayer
+        {
+            alignas(64) int8_t weights[Out][In];
+            alignas(64) int32_t biases[Out];
+            Requantizer requant[Out];
+            float scales[Out]; // real value of one accumulator step, used by the output layer
+
+            /**
+             * @brief Quantizes a float layer.
+             * @param l Float layer.
+             * @param inScale Scale of the input activations.
+             * @param outScale Scale of the output activations (unused for the output layer).
+             */
+            void quantize(const lenet::FcLayer<In, Out>& l, float inScale, float outScale) {
+                for(size_t o = 0; o < Out; o++) {
+                    float scale = int8::quantize(l.weights[o], weights[o], In, 1);
+                    scales[o] = inScale * scale;
+                    biases[o] = static_cast<int32_t>(std::lround(l.biases[o] / scales[o]));
+                    requant[o].set(static_cast<double>(scales[o]) / outScale);
+                }
+            }
+
+            /**
+             * @brief Computes the layer output followed by relu.
+             */
+            void forward(const uint8_t* in, uint8_t* out) const {
+                for(size_t o = 0; o < Out; o++)
+                    out[o] = requant[o].apply(dot<In>(in, weights[o]) + biases[o]);
+            }
+
+            /**
+             * @brief Computes the dequantized layer output (no relu), used by the output layer.
+             */
+            void forward(const uint8_t* in, float* out) const {
+                for(size_t o = 0; o < Out; o++)
+                    out[o] = (dot<In>(in, weights[o]) + biases[o]) * scales[o];
+            }
+        };
+
+        /**
+         * @brief All weights of the quantized MNISTLeNet::LeNet.
+         */
+        struct Weights
+        {
+            ConvLayer<1, Conv1Filters, FilterSize, 1> conv1;
+            ConvLayer<Conv1Filters, Conv2Filters, FilterSize, decltype(conv1)::OutStride> conv2;
+            FcLayer<Features, Fc1Outputs> fc1;
+            FcLayer<Fc1Outputs, Fc2Outputs> fc2;
+            FcLayer<Fc2Outputs, Labels> fc3;
+            Calibration calibration; ///< maxima the activations were quantized with
+
+            /**
+             * @brief Quantizes the float weights.
+             * @param w Float weights.
+             * @param c Maximum activations observed during calibration.
+             */
+            void quantize(const lenet::Weights& w, const Calibration& c) {
+                const float s1 = std::max(c.pool1, 1e-6f) / 255.0f;
+                const float s2 = std::max(c.pool2, 1e-6f) / 255.0f;
+                const float s3 = std::max(c.fc1, 1e-6f) / 255.0f;
+                const float s4 = std::max(c.fc2, 1e-6f) / 255.0f;
+                conv1.quantize(w.conv1, 1.0f, s1);
+                conv2.quantize(w.conv2, s1, s2);
+                fc1.quantize(w.fc1, s2, s3);
+                fc2.quantize(w.fc2, s3, s4);
+                fc3.quantize(w.fc3, s4, 1.0f);
+                calibration = c;
+            }
+        };
+
+        /**
+         * @brief Classifies one digit.
+         * @param w Quantized network weights.
+         * @param img 28x28 grayscale image (row major).
+         * @param probs [out] Label probabilities.
+         */
+        inline void predict(const Weights& w, const unsigned char* img, float* probs) {
+            using Conv1 = decltype(w.conv1);
+            alignas(64) uint8_t pool1[Pool1Size * Pool1Size * Conv1::OutStride];
+            alignas(64) uint8_t pool2[Features];
+            alignas(64) uint8_t fc1[Fc1Outputs];
+            alignas(64) uint8_t fc2[Fc2Outputs];
+
+            w.conv1.forward<ImgSize, ImgSize>(img, pool1);
+            w.conv2.forward<Pool1Size, Pool1Size>(pool1, pool2);
+            w.fc1.forward(pool2, fc1);
+            w.fc2.forward(fc1, fc2);
+            w.fc3.forward(fc2, probs);
+            softmax<Labels>(probs);
+        }
+    }
+}
+
+#endif // LENETINT8_H
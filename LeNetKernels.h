@@ -0,0 +1,262 @@
+/**
+ * @file LeNetKernels.h
+ * @brief Fused convolution/relu/max pooling and fully connected kernels (scalar, AVX2 and NEON) used by the LeNet engine.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#ifndef LENETKERNELS_H
+#define LENETKERNELS_H
+
+#include <cstddef>
+#include <algorithm>
+
+// AVX2 kernels are compiled for all x86 builds and selected at runtime,
+// the static binaries need to keep running on CPUs without AVX2.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    #define LENET_AVX2 1
+    #include <immintrin.h>
+#endif
+
+// NEON is always available on aarch64, on 32 bit arm only if enabled by the compiler flags.
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    #define LENET_NEON 1
+    #include <arm_neon.h>
+#endif
+
+namespace lenet
+{
+namespace kernels
+{
+    /*
+     * All kernels compute a convolution with stride 1, add the biases, apply relu and
+     * reduce 2x2 blocks by max pooling in one pass, no full size intermediate tensor is written.
+     *
+     * Tensors are stored channels last (H x W x Stride), the filters are stored as
+     * InC x K x K x OutStride so the filter values of all output channels of one tap
+     * are contiguous. Every pooled output position keeps the four pre-pooling sums of all
+     * output channels in registers.
+     *
+     * padded:  input zero padded by K/2 pixels, (H + K - 1) x (W + K - 1) x InStride
+     * filters: InC x K x K x OutStride
+     * biases:  OutStride
+     * out:     H/2 x W/2 x OutStride
+     */
+
+    template<size_t InC, size_t InStride, size_t OutStride, size_t K, size_t H, size_t W>
+    void convReluPoolScalar(const float* padded, const float* filters, const float* biases, float* out) {
+        constexpr size_t PW = W + K - 1;
+        for(size_t py = 0; py < H / 2; py++)
+            for(size_t px = 0; px < W / 2; px++) {
+                float acc[4][OutStride] = {};
+                for(size_t c = 0; c < InC; c++)
+                    for(size_t ky = 0; ky < K; ky++)
+                        for(size_t kx = 0; kx < K; kx++) {
+                            const float* w = filters + ((c * K + ky) * K + kx) * OutStride;
+                            const float* src = padded + ((2 * py + ky) * PW + 2 * px + kx) * InStride + c;
+                            const float v[4] = { src[0], src[InStride], src[PW * InStride], src[(PW + 1) * InStride] };
+                            for(size_t d = 0; d < 4; d++)
+                                for(size_t o = 0; o < OutStride; o++)
+                                    acc[d][o] += w[o] * v[d];
+                        }
+                float* dst = out + (py * (W / 2) + px) * OutStride;
+                for(size_t o = 0; o < OutStride; o++) {
+                    float m = std::max(std::max(acc[0][o], acc[1][o]), std::max(acc[2][o], acc[3][o]));
+                    dst[o] = std::max(m + biases[o], 0.0f);
+                }
+            }
+    }
+
+#ifdef LENET_AVX2
+    template<size_t InC, size_t InStride, size_t OutStride, size_t K, size_t H, size_t W>
+    __attribute__((target("avx2,fma")))
+    void convReluPoolAvx2(const float* padded, const float* filters, const float* biases, float* out) {
+        static_assert(OutStride % 8 == 0, "AVX2 kernel expects whole vectors of output channels.");
+        constexpr size_t PW = W + K - 1;
+        constexpr size_t V = OutStride / 8;
+        const __m256 zero = _mm256_setzero_ps();
+        for(size_t py = 0; py < H / 2; py++)
+            for(size_t px = 0; px < W / 2; px++) {
+                __m256 acc[4][V];
+                for(size_t d = 0; d < 4; d++)
+                    for(size_t v = 0; v < V; v++)
+                        acc[d][v] = zero;
+                for(size_t c = 0; c < InC; c++)
+                    for(size_t ky = 0; ky < K; ky++)
+                        for(size_t kx = 0; kx < K; kx++) {
+                            const float* w = filters + ((c * K + ky) * K + kx) * OutStride;
+                            const float* src = padded + ((2 * py + ky) * PW + 2 * px + kx) * InStride + c;
+                            const __m256 in[4] = {
+                                _mm256_broadcast_ss(src),
+                                _mm256_broadcast_ss(src + InStride),
+                                _mm256_broadcast_ss(src + PW * InStride),
+                                _mm256_broadcast_ss(src + (PW + 1) * InStride)
+                            };
+                            for(size_t v = 0; v < V; v++) {
+                                const __m256 wv = _mm256_load_ps(w + 8 * v);
+                                for(size_t d = 0; d < 4; d++)
+                                    acc[d][v] = _mm256_fmadd_ps(wv, in[d], acc[d][v]);
+                            }
+                        }
+                float* dst = out + (py * (W / 2) + px) * OutStride;
+                for(size_t v = 0; v < V; v++) {
+                    __m256 m = _mm256_max_ps(_mm256_max_ps(acc[0][v], acc[1][v]), _mm256_max_ps(acc[2][v], acc[3][v]));
+                    m = _mm256_add_ps(m, _mm256_load_ps(biases + 8 * v));
+                    _mm256_storeu_ps(dst + 8 * v, _mm256_max_ps(m, zero));
+                }
+            }
+    }
+
+    /**
+     * @returns true if the cpu supports AVX2 and FMA.
+     */
+    inline bool hasAvx2() {
+        static const bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+        return avx2;
+    }
+#endif // LENET_AVX2
+
+#ifdef LENET_NEON
+    template<size_t InC, size_t InStride, size_t OutStride, size_t K, size_t H, size_t W>
+    void convReluPoolNeon(const float* padded, const float* filters, const float* biases, float* out) {
+        static_assert(OutStride % 4 == 0, "NEON kernel expects whole vectors of output channels.");
+        constexpr size_t PW = W + K - 1;
+        constexpr size_t V = OutStride / 4;
+        const float32x4_t zero = vdupq_n_f32(0.0f);
+        for(size_t py = 0; py < H / 2; py++)
+            for(size_t px = 0; px < W / 2; px++) {
+                float32x4_t acc[4][V];
+                for(size_t d = 0; d < 4; d++)
+                    for(size_t v = 0; v < V; v++)
+                        acc[d][v] = zero;
+                for(size_t c = 0; c < InC; c++)
+                    for(size_t ky = 0; ky < K; ky++)
+                        for(size_t kx = 0; kx < K; kx++) {
+                            const float* w = filters + ((c * K + ky) * K + kx) * OutStride;
+                            const float* src = padded + ((2 * py + ky) * PW + 2 * px + kx) * InStride + c;
+                            const float in[4] = { src[0], src[InStride], src[PW * InStride], src[(PW + 1) * InStride] };
+                            for(size_t v = 0; v < V; v++) {
+                                const float32x4_t wv = vld1q_f32(w + 4 * v);
+                                for(size_t d = 0; d < 4; d++)
+                                #if defined(__aarch64__)
+                                    acc[d][v] = vfmaq_n_f32(acc[d][v], wv, in[d]);
+                                #else
+                                    acc[d][v] = vmlaq_n_f32(acc[d][v], wv, in[d]);
+                                #endif
+                            }
+                        }
+                float* dst = out + (py * (W / 2) + px) * OutStride;
+                for(size_t v = 0; v < V; v++) {
+                    float32x4_t m = vmaxq_f32(vmaxq_f32(acc[0][v], acc[1][v]), vmaxq_f32(acc[2][v], acc[3][v]));
+                    m = vaddq_f32(m, vld1q_f32(biases + 4 * v));
+                    vst1q_f32(dst + 4 * v, vmaxq_f32(m, zero));
+                }
+            }
+    }
+#endif // LENET_NEON
+
+    /*
+     * Fully connected kernels compute a tile of Tile input vectors at once, so every weight
+     * row is loaded once per tile instead of once per digit.
+     *
+     * weights: Out x InStride, InStride is a multiple of 8, unused columns are 0
+     * biases:  Out
+     * in:      Tile x InStride
+     * out:     Tile x OutStride, columns Out to OutStride are set to 0
+     */
+
+    template<size_t InStride, size_t Out, size_t OutStride, size_t Tile, bool Relu>
+    void fcScalar(const float* weights, const float* biases, const float* in, float* out) {
+        static_assert(InStride % 8 == 0, "Input stride needs to be a multiple of 8.");
+        for(size_t o = 0; o < Out; o++) {
+            // eight independent partial sums per input vector, lets the compiler vectorize the inner loop
+            float acc[Tile][8] = {};
+            const float* w = weights + o * InStride;
+            for(size_t i = 0; i < InStride; i += 8)
+                for(size_t t = 0; t < Tile; t++)
+                    for(size_t l = 0; l < 8; l++)
+                        acc[t][l] += w[i + l] * in[t * InStride + i + l];
+            for(size_t t = 0; t < Tile; t++) {
+                float sum = biases[o];
+                for(size_t l = 0; l < 8; l++)
+                    sum += acc[t][l];
+                out[t * OutStride + o] = Relu ? std::max(sum, 0.0f) : sum;
+            }
+        }
+        for(size_t t = 0; t < Tile; t++)
+            std::fill(out + t * OutStride + Out, out + (t + 1) * OutStride, 0.0f);
+    }
+
+#ifdef LENET_AVX2
+    template<size_t InStride, size_t Out, size_t OutStride, size_t Tile, bool Relu>
+    __attribute__((target("avx2,fma")))
+    void fcAvx2(const float* weights, const float* biases, const float* in, float* out) {
+        static_assert(InStride % 8 == 0, "Input stride needs to be a multiple of 8.");
+        for(size_t o = 0; o < Out; o++) {
+            __m256 acc[Tile];
+            for(size_t t = 0; t < Tile; t++)
+                acc[t] = _mm256_setzero_ps();
+            const float* w = weights + o * InStride;
+            for(size_t i = 0; i < InStride; i += 8) {
+                const __m256 wv = _mm256_load_ps(w + i);
+                for(size_t t = 0; t < Tile; t++)
+                    acc[t] = _mm256_fmadd_ps(wv, _mm256_load_ps(in + t * InStride + i), acc[t]);
+            }
+            for(size_t t = 0; t < Tile; t++) {
+                // horizontal sum of the eight lanes
+                __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc[t]), _mm256_extractf128_ps(acc[t], 1));
+                s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+                s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+                float sum = _mm_cvtss_f32(s) + biases[o];
+                out[t * OutStride + o] = Relu ? std::max(sum, 0.0f) : sum;
+            }
+        }
+        for(size_t t = 0; t < Tile; t++)
+            std::fill(out + t * OutStride + Out, out + (t + 1) * OutStride, 0.0f);
+    }
+#endif // LENET_AVX2
+
+    /**
+     * @brief Fully connected layer on a tile of input vectors, uses the fastest kernel supported by the cpu.
+     */
+    template<size_t InStride, size_t Out, size_t OutStride, size_t Tile, bool Relu>
+    void fc(const float* weights, const float* biases, const float* in, float* out) {
+    #if defined(LENET_AVX2)
+        if(hasAvx2())
+            return fcAvx2<InStride, Out, OutStride, Tile, Relu>(weights, biases, in, out);
+    #endif
+        fcScalar<InStride, Out, OutStride, Tile, Relu>(weights, biases, in, out);
+    }
+
+    /**
+     * @returns true if convReluPool uses a SIMD kernel on this cpu.
+     */
+    inline bool vectorized() {
+    #if defined(LENET_AVX2)
+        return hasAvx2();
+    #elif defined(LENET_NEON)
+        return true;
+    #else
+        return false;
+    #endif
+    }
+
+    /**
+     * @brief Fused convolution, relu and 2x2 max pooling, uses the fastest kernel supported by the cpu.
+     */
+    template<size_t InC, size_t InStride, size_t OutStride, size_t K, size_t H, size_t W>
+    void convReluPool(const float* padded, const float* filters, const float* biases, float* out) {
+    #if defined(LENET_AVX2)
+        if(hasAvx2())
+            return convReluPoolAvx2<InC, InStride, OutStride, K, H, W>(padded, filters, biases, out);
+    #elif defined(LENET_NEON)
+        return convReluPoolNeon<InC, InStride, OutStride, K, H, W>(padded, filters, biases, out);
+    #endif
+        convReluPoolScalar<InC, InStride, OutStride, K, H, W>(padded, filters, biases, out);
+    }
+}
+}
+
+#endif // LENETKERNELS_H
@@ -0,0 +1,345 @@
+/**
+ * @file LeNetPruned.h
+ * @brief Structured pruning of MNISTLeNet::LeNet and inference engine for the compacted network.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#ifndef LENETPRUNED_H
+#define LENETPRUNED_H
+
+#include <vector>
+#include <array>
+#include <utility>
+#include <new>
+#include <numeric>
+#include <cmath>
+#include <algorithm>
+#include "LeNetEngine.h"
+
+/**
+ * @brief Structured pruning of MNISTLeNet::LeNet and inference engine for the compacted network.
+ *
+ * Pruning removes whole conv filters and fc neurons with the smallest L1 norm together with
+ * the inputs of the following layer that depend on them. The result is a dense network with
+ * fewer channels, so no sparse storage or index lists are needed at inference time.
+ *
+ * The layer widths of the compacted network are only known at runtime. The layers below
+ * store exactly the remaining weights and dispatch to kernels matching their widths,
+ * buffers are sized for the unpruned shapes and live on the stack. Like the static engine
+ * the weights are only read during inference and can be shared by all threads.
+ */
+namespace lenet
+{
+    namespace pruned
+    {
+        /**
+         * @brief Allocator returning 64 byte aligned memory, the SIMD kernels use aligned loads.
+         */
+        template<typename T>
+        struct AlignedAllocator
+        {
+            using value_type = T;
+            AlignedAllocator() = default;
+            template<typename U> AlignedAllocator(const AlignedAllocator<U>&) {}
+            T* allocate(size_t n) { return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(64))); }
+            void deallocate(T* p, size_t) { ::operator delete(p, std::align_val_t(64)); }
+            template<typename U> bool operator==(const AlignedAllocator<U>&) const { return true; }
+            template<typename U> bool operator!=(const AlignedAllocator<U>&) const { return false; }
+        };
+        using AlignedVector = std::vector<float, AlignedAllocator<float>>;
+
+        /**
+         * @brief L1 norm of every filter of a dlib con_ layer.
+         * @param params dlib layer parameters, all filters (outC x inC x K x K) followed by the biases.
+         */
+        inline std::vector<float> filterNorms(const float* params, size_t inC, size_t outC, size_t K) {
+            std::vector<float> norms(outC, 0.0f);
+            for(size_t o = 0; o < outC; o++)
+                for(size_t i = 0; i < inC * K * K; i++)
+                    norms[o] += std::fabs(params[o * inC * K * K + i]);
+            return norms;
+        }
+
+        /**
+         * @brief L1 norm of the input weights of every neuron of a dlib fc_ layer.
+         * @param params dlib layer parameters, weight matrix (in x out) followed by the biases.
+         */
+        inline std::vector<float> neuronNorms(const float* params, size_t in, size_t out) {
+            std::vector<float> norms(out, 0.0f);
+            for(size_t i = 0; i < in; i++)
+                for(size_t o = 0; o < out; o++)
+                    norms[o] += std::fabs(params[i * out + o]);
+            return norms;
+        }
+
+        /**
+         * @returns Indices of the keep entries with the largest norm, in ascending order.
+         */
+        inline std::vector<size_t> strongest(const std::vector<float>& norms, size_t keep) {
+            std::vector<size_t> idx(norms.size());
+            std::iota(idx.begin(), idx.end(), 0);
+            keep = std::min(std::max<size_t>(keep, 1), idx.size());
+            std::stable_sort(idx.begin(), idx.end(), [&](size_t l, size_t r){ return norms[l] > norms[r]; });
+            idx.resize(keep);
+            std::sort(idx.begin(), idx.end());
+            return idx;
+        }
+
+        /**
+         * @brief Removes filters and input channels of a dlib con_ layer.
+         * @returns Parameters of the compacted layer (dlib layout).
+         */
+        inline std::vector<float> compactConv(const float* params, size_t inC, size_t outC, size_t K,
+                                              const std::vector<size_t>& keepIn, const std::vector<size_t>& keepOut) {
+            std::vector<float> res;
+            res.reserve(keepOut.size() * keepIn.size() * K * K + keepOut.size());
+            for(size_t o : keepOut)
+                for(size_t c : keepIn)
+                    res.insert(res.end(), params + (o * inC + c) * K * K, params + (o * inC + c + 1) * K * K);
+            for(size_t o : keepOut)
+                res.push_back(params[outC * inC * K * K + o]);
+            return res;
+        }
+
+        /**
+         * @brief Removes neurons and inputs of a dlib fc_ layer.
+         * @returns Parameters of the compacted layer (dlib layout).
+         */
+        inline std::vector<float> compactFc(const float* params, size_t in, size_t out,
+                                            const std::vector<size_t>& keepIn, const std::vector<size_t>& keepOut) {
+            std::vector<float> res;
+            res.reserve(keepIn.size() * keepOut.size() + keepOut.size());
+            for(size_t i : keepIn)
+                for(size_t o : keepOut)
+                    res.push_back(params[i * out + o]);
+            for(size_t o : keepOut)
+                res.push_back(params[in * out + o]);
+            return res;
+        }
+
+        /**
+         * @brief Inputs of a fully connected layer fed by the remaining channels of a C x H x W tensor (dlib flattens channel by channel).
+         */
+        inline std::vector<size_t> expandChannels(const std::vector<size_t>& channels, size_t pixels) {
+            std::vector<size_t> res;
+            for(size_t c : channels)
+                for(size_t i = 0; i < pixels; i++)
+                    res.push_back(c * pixels + i);
+            return res;
+        }
+
+        /**
+         * @brief Convolution layer with a runtime number of channels, stride 1 and zero padding
+         * of K/2 pixels, followed by relu and 2x2 max pooling (see lenet::ConvLayer).
+         *
+         * The fused kernels of the static engine are instantiated for every possible number of
+         * input channels and output stride, forward() picks the matching one at runtime.
+         * @tparam MaxInC Maximum number of input channels.
+         * @tparam MaxOutC Maximum number of filters.
+         * @tparam K Filter size (KxK).
+         */
+        template<size_t MaxInC, size_t MaxOutC, size_t K>
+        struct ConvLayer
+        {
+            static constexpr size_t MaxOutStride = (MaxOutC + 7) / 8 * 8;
+
+            size_t inC = 0;
+            size_t outC = 0;
+            size_t outStride = 0; // output channels padded to whole SIMD vectors (8 floats)
+
+            // stored as inC x K x K x outStride, the values of all filters for one tap are contiguous
+            AlignedVector filters;
+            AlignedVector biases;
+
+            /**
+             * @brief Loads the parameters of a dlib con_ layer.
+             * @param params dlib layer parameters, all filters (out x in x K x K) followed by the biases.
+             * @param in Number of input channels (1 ... MaxInC).
+             * @param out Number of filters (1 ... MaxOutC).
+             */
+            void load(const float* params, size_t in, size_t out) {
+                inC = in;
+                outC = out;
+                outStride = (out + 7) / 8 * 8;
+                filters.assign(inC * K * K * outStride, 0.0f);
+                biases.assign(outStride, 0.0f);
+                for(size_t o = 0; o < outC; o++)
+                    for(size_t c = 0; c < inC; c++)
+                        for(size_t ky = 0; ky < K; ky++)
+                            for(size_t kx = 0; kx < K; kx++)
+                                filters[((c * K + ky) * K + kx) * outStride + o] = params[((o * inC + c) * K + ky) * K + kx];
+                std::copy(params + outC * inC * K * K, params + outC * inC * K * K + outC, biases.begin());
+            }
+
+            /**
+             * @brief Computes convolution, relu and max pooling in one pass.
+             * @tparam H Input height (even).
+             * @tparam W Input width (even).
+             * @tparam InStride Distance between two pixels of the input (>= inC).
+             * @param in Input tensor (H x W x InStride).
+             * @param out Output tensor (H/2 x W/2 x outStride), padding channels are set to 0.
+             */
+            template<size_t H, size_t W, size_t InStride>
+            void forward(const float* in, float* out) const {
+                static_assert(InStride >= MaxInC, "Input stride is smaller than the number of channels.");
+                constexpr size_t P = K / 2;
+                constexpr size_t PH = H + K - 1;
+                constexpr size_t PW = W + K - 1;
+                static constexpr auto table = kernelTable<H, W, InStride>(std::make_index_sequence<MaxInC>());
+
+                // zero padded copy of the input, avoids bounds checks within the kernels
+                alignas(64) float padded[PH * PW * InStride] = {};
+                for(size_t y = 0; y < H; y++)
+                    std::copy(in + y * W * InStride, in + (y + 1) * W * InStride, padded + ((y + P) * PW + P) * InStride);
+
+                table[inC - 1][outStride / 8 - 1](padded, filters.data(), biases.data(), out);
+            }
+
+        private:
+            using Kernel = void (*)(const float*, const float*, const float*, float*);
+            static constexpr size_t OutBlocks = MaxOutStride / 8;
+
+            template<size_t H, size_t W, size_t InStride, size_t InC, size_t... Blocks>
+            static constexpr std::array<Kernel, OutBlocks> kernelRow(std::index_sequence<Blocks...>) {
+                return {{ &kernels::convReluPool<InC, InStride, (Blocks + 1) * 8, K, H, W>... }};
+            }
+
+            // table[inC - 1][outStride / 8 - 1] holds the kernel for inC input channels and outStride
+            template<size_t H, size_t W, size_t InStride, size_t... InCs>
+            static constexpr std::array<std::array<Kernel, OutBlocks>, MaxInC> kernelTable(std::index_sequence<InCs...>) {
+                return {{ kernelRow<H, W, InStride, InCs + 1>(std::make_index_sequence<OutBlocks>())... }};
+            }
+        };
+
+        /**
+         * @brief Fully connected layer with a runtime number of inputs and outputs.
+         * @tparam MaxIn Maximum number of inputs.
+         * @tparam MaxOut Maximum number of outputs.
+         */
+        template<size_t MaxIn, size_t MaxOut>
+        struct FcLayer
+        {
+            size_t in = 0;
+            size_t inStride = 0; // inputs padded to whole SIMD vectors (8 floats)
+            size_t out = 0;
+
+            // stored transposed to dlib (one row per output), dot products read contiguous memory
+            AlignedVector weights;
+            AlignedVector biases;
+
+            /**
+             * @brief Loads the parameters of a dlib fc_ layer.
+             * @param params dlib layer parameters, weight matrix (inputs x outputs) followed by the biases.
+             * @param inputs Number of inputs (<= MaxIn).
+             * @param outputs Number of outputs (<= MaxOut).
+             */
+            void load(const float* params, size_t inputs, size_t outputs) {
+                resize(inputs, outputs);
+                for(size_t i = 0; i < in; i++)
+                    for(size_t o = 0; o < out; o++)
+                        weights[o * inStride + i] = params[i * out + o];
+                std::copy(params + in * out, params + in * out + out, biases.begin());
+            }
+
+            /**
+             * @brief Loads the parameters of a dlib fc_ layer whose input is a C x H x W tensor
+             * that is stored channels last (H x W x stride) by this engine.
+             * @param params dlib layer parameters, weight matrix (C * H * W x outputs) followed by the biases.
+             * @param C Number of input channels.
+             * @param stride Distance between two pixels of the input (>= C).
+             * @param pixels Number of input pixels (H * W).
+             * @param outputs Number of outputs (<= MaxOut).
+             */
+            void loadChannelsLast(const float* params, size_t C, size_t stride, size_t pixels, size_t outputs) {
+                resize(pixels * stride, outputs);
+                for(size_t c = 0; c < C; c++)
+                    for(size_t i = 0; i < pixels; i++)
+                        for(size_t o = 0; o < out; o++)
+                            weights[o * inStride + i * stride + c] = params[(c * pixels + i) * out + o];
+                std::copy(params + C * pixels * out, params + C * pixels * out + out, biases.begin());
+            }
+
+            /**
+             * @brief Computes the layer output.
+             * @param input Input vector (inStride values, padding needs to be 0).
+             * @param output [out] Output vector (out values).
+             * @param relu Apply relu to the output.
+             */
+            void forward(const float* input, float* output, bool relu) const {
+                for(size_t o = 0; o < out; o++) {
+                    // 8 independent partial sums, lets the compiler vectorize the dot product
+                    const float* w = weights.data() + o * inStride;
+                    float sum[8] = {};
+                    for(size_t i = 0; i < inStride; i += 8)
+                        for(size_t k = 0; k < 8; k++)
+                            sum[k] += input[i + k] * w[i + k];
+                    float v = biases[o];
+                    for(size_t k = 0; k < 8; k++)
+                        v += sum[k];
+                    output[o] = relu ? std::max(v, 0.0f) : v;
+                }
+            }
+
+        private:
+            void resize(size_t inputs, size_t outputs) {
+                in = inputs;
+                inStride = (inputs + 7) / 8 * 8;
+                out = outputs;
+                weights.assign(out * inStride, 0.0f);
+                biases.assign(out, 0.0f);
+            }
+        };
+
+        /**
+         * @brief All weights of the compacted MNISTLeNet::LeNet.
+         */
+        struct Weights
+        {
+            ConvLayer<1, Conv1Filters, FilterSize> conv1;
+            ConvLayer<Conv1Filters, Conv2Filters, FilterSize> conv2;
+            FcLayer<Features, Fc1Outputs> fc1;
+            FcLayer<Fc1Outputs, Fc2Outputs> fc2;
+            FcLayer<Fc2Outputs, Labels> fc3;
+
+            /**
+             * @returns Number of weights and biases used at inference time (without padding).
+             */
+            size_t parameters() const {
+                return conv1.outC * (conv1.inC * FilterSize * FilterSize + 1) +
+                       conv2.outC * (conv2.inC * FilterSize * FilterSize + 1) +
+                       conv2.outC * Pool2Size * Pool2Size * fc1.out + fc1.out +
+                       fc2.in * fc2.out + fc2.out + fc3.in * fc3.out + fc3.out;
+            }
+        };
+
+        /**
+         * @brief Classifies one digit.
+         * @param w Compacted network weights.
+         * @param img 28x28 grayscale image (row major).
+         * @param probs [out] Label probabilities.
+         */
+        inline void predict(const Weights& w, const unsigned char* img, float* probs) {
+            using Conv1 = decltype(w.conv1);
+            using Conv2 = decltype(w.conv2);
+            static_assert(Conv1::MaxOutStride == 8, "conv2 expects the same input stride for any number of remaining conv1 filters.");
+            alignas(64) float in[ImgSize * ImgSize];
+            alignas(64) float pool1[Pool1Size * Pool1Size * Conv1::MaxOutStride];
+            alignas(64) float pool2[Pool2Size * Pool2Size * Conv2::MaxOutStride];
+            alignas(64) float fc1[(Fc1Outputs + 7) / 8 * 8] = {};
+            alignas(64) float fc2[(Fc2Outputs + 7) / 8 * 8] = {};
+
+            std::copy(img, img + ImgSize * ImgSize, in);
+            w.conv1.forward<ImgSize, ImgSize, 1>(in, pool1);
+            w.conv2.forward<Pool1Size, Pool1Size, Conv1::MaxOutStride>(pool1, pool2);
+            w.fc1.forward(pool2, fc1, true);
+            w.fc2.forward(fc1, fc2, true);
+            w.fc3.forward(fc2, probs, false);
+            softmax<Labels>(probs);
+        }
+    }
+}
+
+#endif // LENETPRUNED_H
@@ -0,0 +1,239 @@
+/**
+ * @file LeNetTests.cpp
+ * @brief Checks of the inference engines and the weight file format, run by make check.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#include "MNISTLeNet.h"
+#include "LeNetWeightFile.h"
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <dlib/data_io.h>
+
+using namespace dlib;
+
+namespace
+{
+    int failures = 0;
+
+    void check(bool ok, const std::string& what) {
+        std::cout << (ok ? "ok      " : "FAILED  ") << what << std::endl;
+        if(!ok)
+            failures++;
+    }
+
+    /**
+     * @brief Digits made of a few bright strokes on a dark background, the same on every run.
+     */
+    InferenceBackend::Digits fixedDigits(size_t count) {
+        std::mt19937 rng(42);
+        std::uniform_int_distribution<int> pos(4, 23);
+        std::uniform_int_distribution<int> len(3, 12);
+        InferenceBackend::Digits digits(count);
+        for(auto& digit : digits) {
+            digit = zeros_matrix<unsigned char>(28, 28);
+            for(int stroke = 0; stroke < 4; stroke++) {
+                const bool vertical = rng() % 2;
+                const int x = pos(rng), y = pos(rng), l = len(rng);
+                for(int i = 0; i < l; i++) {
+                    const int r = std::min(27, vertical ? y + i : y);
+                    const int c = std::min(27, vertical ? x : x + i);
+                    digit(r, c) = static_cast<unsigned char>(128 + rng() % 128);
+                }
+            }
+        }
+        return digits;
+    }
+
+    /**
+     * @brief Writes digits as mnist test set (idx files), used to calibrate the int8 engine.
+     */
+    void writeTestSet(const std::filesystem::path& dir, const InferenceBackend::Digits& digits) {
+        auto field = [](std::ostream& out, uint32_t value) {
+            for(int shift = 24; shift >= 0; shift -= 8)
+                out.put(static_cast<char>(value >> shift));
+        };
+        std::ofstream images(dir / "t10k-images-idx3-ubyte", std::ios::binary);
+        std::ofstream labels(dir / "t10k-labels-idx1-ubyte", std::ios::binary);
+        field(images, 2051);
+        field(images, static_cast<uint32_t>(digits.size()));
+        field(images, 28);
+        field(images, 28);
+        field(labels, 2049);
+        field(labels, static_cast<uint32_t>(digits.size()));
+        for(size_t i = 0; i < digits.size(); i++) {
+            images.write(reinterpret_cast<const char*>(&digits[i](0, 0)), 28 * 28);
+            labels.put(static_cast<char>(i % 10));
+        }
+    }
+
+    float maxDifference(const InferenceBackend::Probabilities& a, const InferenceBackend::Probabilities& b) {
+        if(a.size() != b.size())
+            return std::numeric_limits<float>::infinity();
+        float diff = 0;
+        for(size_t i = 0; i < a.size(); i++)
+            diff = std::max(diff, dlib::max(abs(a[i] - b[i])));
+        return diff;
+    }
+
+    double agreement(const InferenceBackend::Probabilities& a, const InferenceBackend::Probabilities& b) {
+        size_t same = 0;
+        for(size_t i = 0; i < std::min(a.size(), b.size()); i++)
+            same += index_of_max(a[i]) == index_of_max(b[i]);
+        return a.empty() || a.size() != b.size() ? 0 : static_cast<double>(same) / a.size();
+    }
+
+    /**
+     * @brief Round trip of both weight file types, corrupted files and files of another network are rejected.
+     */
+    void testWeightFile(const std::filesystem::path& dir) {
+        std::mt19937 rng(7);
+        std::uniform_real_distribution<float> value(-1, 1);
+        auto weights = std::make_shared<lenet::Weights>();
+        float* params = reinterpret_cast<float*>(weights.get());
+        for(size_t i = 0; i < sizeof(lenet::Weights) / sizeof(float); i++)
+            params[i] = value(rng);
+        auto quantized = std::make_shared<lenet::int8::Weights>();
+        quantized->quantize(*weights, lenet::Calibration{ 4, 8, 16, 32 });
+
+        const auto file = dir / "check.weights";
+        const auto quantizedFile = dir / "check.int8";
+        const uint64_t source = 0x1234;
+        lenet::saveWeights(*weights, file, source);
+        lenet::saveWeights(*quantized, quantizedFile, source);
+        check(std::memcmp(lenet::mapWeights(file, source).get(), weights.get(), sizeof(lenet::Weights)) == 0, "weight file round trip");
+        auto mapped = lenet::mapQuantizedWeights(quantizedFile, source);
+        check(std::memcmp(mapped.get(), quantized.get(), sizeof(lenet::int8::Weights)) == 0 && mapped->calibration.fc2 == 32,
+              "quantized weight file round trip");
+
+        auto rejects = [](auto load) {
+            try
+            {
+                load();
+                return false;
+            }
+            catch(std::runtime_error&)
+            {
+                return true;
+            }
+        };
+        check(rejects([&]() { lenet::mapWeights(file, source + 1); }), "weight file of another network rejected");
+        check(rejects([&]() { lenet::mapWeights(quantizedFile, source); }), "quantized weight file rejected as float weights");
+        {
+            // flip one byte of the payload
+            std::fstream f(file, std::ios::in | std::ios::out | std::ios::binary);
+            f.seekg(lenet::WeightFileHeaderSize + 1000);
+            const char byte = static_cast<char>(f.get() ^ 0x40);
+            f.seekp(lenet::WeightFileHeaderSize + 1000);
+            f.put(byte);
+        }
+        check(rejects([&]() { lenet::mapWeights(file, source); }), "checksum mismatch detected");
+
+        const auto hashed = dir / "check.dat";
+        std::ofstream(hashed) << "network";
+        const uint64_t hash = lenet::hashFile(hashed);
+        std::ofstream(hashed) << "Network";
+        check(hash != lenet::hashFile(hashed), "source hash changes with the network file");
+    }
+
+    /**
+     * @brief Engines reproducing the reference network, compared on a randomly initialized LeNet.
+     */
+    void testEngines(const std::filesystem::path& dir) {
+        auto digits = fixedDigits(64);
+        {
+            // dlib initializes the parameters randomly on the first forward pass
+            MNISTLeNet::LeNet net;
+            net(digits);
+            net.clean();
+            serialize((dir / "mnist_network.dat").string()) << net;
+        }
+        writeTestSet(dir, digits);
+
+        MNISTLeNet lenet(dir, 1, "dlib");
+        auto reference = lenet.backend("dlib")->classify(digits);
+        auto single = lenet.backend("dlib")->classify({ digits[3] });
+        check(single.size() == 1 && maxDifference(single, { reference[3] }) < 1e-5f, "dlib: single digit matches batch");
+
+        auto quantized = lenet.backend("int8")->classify(digits);
+        const float staticDiff = maxDifference(lenet.backend("static")->classify(digits), reference);
+        const float int8Diff = maxDifference(quantized, reference);
+        check(staticDiff < 1e-4f, "static matches dlib (max difference " + std::to_string(staticDiff) + ")");
+        check(int8Diff < 0.05f, "int8 close to dlib (max difference " + std::to_string(int8Diff) + ")");
+
+        // a second instance maps the exported files instead of exporting and calibrating again
+        check(std::filesystem::exists(dir / "mnist_network.weights") && std::filesystem::exists(dir / "mnist_network.int8"), "weight files exported");
+        std::filesystem::remove(dir / "t10k-images-idx3-ubyte");
+        MNISTLeNet mapped(dir, 1, "int8");
+        check(maxDifference(mapped.backend("int8")->classify(digits), quantized) == 0, "int8 weights loaded without calibration data");
+    }
+
+    /**
+     * @brief All engines of a trained network compared with the dlib reference on the mnist test set.
+     */
+    void testTrained(const std::filesystem::path& mnist) {
+        const bool found = std::filesystem::exists(mnist / "mnist_network.dat") &&
+                           std::filesystem::exists(mnist / "train-images-idx3-ubyte") && std::filesystem::exists(mnist / "train-labels-idx1-ubyte") &&
+                           std::filesystem::exists(mnist / "t10k-images-idx3-ubyte") && std::filesystem::exists(mnist / "t10k-labels-idx1-ubyte");
+        if(!found) {
+            std::cout << "skipped trained network checks, no trained network and mnist dataset in " << mnist.string() << std::endl;
+            return;
+        }
+        std::vector<matrix<unsigned char>> training_images, testing_images;
+        std::vector<unsigned long> training_labels, testing_labels;
+        load_mnist_dataset(mnist.string(), training_images, training_labels, testing_images, testing_labels);
+        InferenceBackend::Digits digits(testing_images.begin(), testing_images.begin() + std::min<size_t>(500, testing_images.size()));
+
+        MNISTLeNet lenet(mnist, 1, "dlib");
+        auto reference = lenet.backend("dlib")->classify(digits);
+        const std::vector<std::pair<std::string, double>> engines = { { "static", 1.0 }, { "int8", 0.99 }, { "pruned", 0.95 }, { "student", 0.95 } };
+        for(auto const& [engine, minimum] : engines) {
+            // derived networks are not created by the checks, this would need a training run
+            if((engine == "pruned" && !std::filesystem::exists(mnist / "mnist_pruned_network.dat")) ||
+               (engine == "student" && !std::filesystem::exists(mnist / "mnist_student_network.dat"))) {
+                std::cout << "skipped " << engine << ", network not found" << std::endl;
+                continue;
+            }
+            const double agree = agreement(lenet.backend(engine)->classify(digits), reference);
+            check(agree >= minimum, engine + " labels agree with dlib on " + std::to_string(agree * 100) + "% of the test digits");
+        }
+    }
+}
+
+/**
+ * Usage: lenet_check [mnist folder]
+ * Runs on a randomly initialized network in a temporary folder, the engines of a trained
+ * network are compared as well if a folder with the network and the mnist dataset is given.
+ */
+int main(int argc, char** argv)
+{
+    const auto dir = std::filesystem::temp_directory_path() / "mnist_lenet_check";
+    try
+    {
+        std::filesystem::remove_all(dir);
+        std::filesystem::create_directories(dir);
+        testWeightFile(dir);
+        testEngines(dir);
+        if(argc > 1)
+            testTrained(argv[1]);
+    }
+    catch(const giri::ExceptionBase& e)
+    {
+        check(false, "unexpected exception: " + e.getMessage());
+    }
+    catch(const std::exception& e)
+    {
+        check(false, std::string("unexpected exception: ") + e.what());
+    }
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+
+    std::cout << (failures ? std::to_string(failures) + " check(s) failed" : "all checks passed") << std::endl;
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
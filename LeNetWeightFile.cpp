@@ -0,0 +1,316 @@
+/**
+ * @file LeNetWeightFile.cpp
+ * @brief Flat, memory mapped file format for the weights of the static and int8 inference engines.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#include "LeNetWeightFile.h"
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// weight files compiled into the executable by make embed, not needed by the host build exporting them
+#if defined(__has_include) && !defined(LENET_NO_EMBEDDED_WEIGHTS)
+#if __has_include("LeNetEmbeddedWeights.h")
+#include "LeNetEmbeddedWeights.h"
+#define LENET_EMBEDDED_WEIGHTS
+#endif
+#endif
+
+namespace lenet
+{
+namespace
+{
+    static_assert(std::is_trivially_copyable<Weights>::value && std::is_trivially_copyable<int8::Weights>::value,
+                  "Weights need to be stored as plain bytes.");
+    static_assert(sizeof(Weights) % sizeof(float) == 0, "Weights need to consist of floats only.");
+    static_assert(alignof(Weights) <= 64 && alignof(int8::Weights) <= 64, "Payload offset does not satisfy the alignment of the weights.");
+    static_assert(sizeof(Weights) <= UINT32_MAX && sizeof(int8::Weights) <= UINT32_MAX, "Payload size does not fit into the header.");
+
+    // header field offsets
+    constexpr size_t VersionOffset = 8;
+    constexpr size_t ShapesOffset = 12;
+    constexpr size_t PayloadOffsetOffset = 40;
+    constexpr size_t PayloadSizeOffset = 44;
+    constexpr size_t ChecksumOffset = 48;
+    constexpr size_t SourceOffset = 56;
+
+    // shapes of the stored network, files written for other shapes are rejected
+    constexpr uint32_t Shapes[] = { ImgSize, Conv1Filters, Conv2Filters, FilterSize, Fc1Outputs, Fc2Outputs, Labels };
+    static_assert(ShapesOffset + sizeof(Shapes) <= PayloadOffsetOffset, "Header fields overlap.");
+
+    bool littleEndian() {
+        const uint32_t one = 1;
+        unsigned char first;
+        std::memcpy(&first, &one, 1);
+        return first == 1;
+    }
+
+    void putLE(unsigned char* dst, uint64_t value, size_t bytes) {
+        for(size_t i = 0; i < bytes; i++)
+            dst[i] = static_cast<unsigned char>(value >> (8 * i));
+    }
+
+    uint64_t getLE(const unsigned char* src, size_t bytes) {
+        uint64_t value = 0;
+        for(size_t i = 0; i < bytes; i++)
+            value |= uint64_t(src[i]) << (8 * i);
+        return value;
+    }
+
+    // reverses the byte order of every 32 bit word of data in place
+    template<typename T>
+    void swapWords(T& data) {
+        static_assert(sizeof(T) % 4 == 0, "Data does not consist of 32 bit words.");
+        unsigned char* bytes = reinterpret_cast<unsigned char*>(&data);
+        for(size_t i = 0; i < sizeof(T); i += 4) {
+            std::swap(bytes[i], bytes[i + 3]);
+            std::swap(bytes[i + 1], bytes[i + 2]);
+        }
+    }
+
+    // converts between host and file byte order on big endian hosts
+    void swapByteOrder(Weights& w) {
+        swapWords(w);
+    }
+
+    // the int8 weights keep their order, biases, requantizers, scales and calibration are 32 bit words
+    void swapByteOrder(int8::Weights& w) {
+        auto layer = [](auto& l) {
+            swapWords(l.biases);
+            swapWords(l.requant);
+        };
+        layer(w.conv1);
+        layer(w.conv2);
+        layer(w.fc1);
+        layer(w.fc2);
+        layer(w.fc3);
+        swapWords(w.fc1.scales);
+        swapWords(w.fc2.scales);
+        swapWords(w.fc3.scales);
+        swapWords(w.calibration);
+    }
+
+    // magic of the files holding W
+    template<typename W> const char* magic();
+    template<> const char* magic<Weights>() { return WeightFileMagic; }
+    template<> const char* magic<int8::Weights>() { return QuantizedWeightFileMagic; }
+
+    constexpr uint64_t Fnv1aBasis = 14695981039346656037ull;
+
+    uint64_t fnv1a(const unsigned char* data, size_t size, uint64_t hash = Fnv1aBasis) {
+        for(size_t i = 0; i < size; i++) {
+            hash ^= data[i];
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+
+    /**
+     * @brief Read only mapping of a whole file, unmapped on destruction.
+     */
+    class MappedFile
+    {
+    public:
+        explicit MappedFile(const std::filesystem::path& file) {
+#if defined(_WIN32)
+            HANDLE handle = CreateFileW(file.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if(handle == INVALID_HANDLE_VALUE)
+                throw std::runtime_error("Unable to open weight file: " + file.string());
+            LARGE_INTEGER size;
+            HANDLE mapping = nullptr;
+            if(GetFileSizeEx(handle, &size) && size.QuadPart > 0) {
+                m_Size = static_cast<size_t>(size.QuadPart);
+                mapping = CreateFileMappingW(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            }
+            if(mapping)
+                m_Data = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+            // the view keeps the mapping alive
+            if(mapping)
+                CloseHandle(mapping);
+            CloseHandle(handle);
+            if(!m_Data)
+                throw std::runtime_error("Unable to map weight file: " + file.string());
+#else
+            int fd = open(file.c_str(), O_RDONLY);
+            if(fd < 0)
+                throw std::runtime_error("Unable to open weight file: " + file.string());
+            struct stat st;
+            void* data = MAP_FAILED;
+            if(fstat(fd, &st) == 0 && st.st_size > 0) {
+                m_Size = static_cast<size_t>(st.st_size);
+                data = mmap(nullptr, m_Size, PROT_READ, MAP_SHARED, fd, 0);
+            }
+            // the mapping stays valid after closing the descriptor
+            close(fd);
+            if(data == MAP_FAILED)
+                throw std::runtime_error("Unable to map weight file: " + file.string());
+            m_Data = static_cast<const unsigned char*>(data);
+#endif
+        }
+
+        ~MappedFile() {
+#if defined(_WIN32)
+            UnmapViewOfFile(m_Data);
+#else
+            munmap(const_cast<unsigned char*>(m_Data), m_Size);
+#endif
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        const unsigned char* data() const { return m_Data; }
+        size_t size() const { return m_Size; }
+
+    private:
+        const unsigned char* m_Data = nullptr;
+        size_t m_Size = 0;
+    };
+
+    /**
+     * @brief Checks a weight file held in memory and returns its weights.
+     * @tparam W Type of the stored weights (Weights or int8::Weights).
+     * @param owner Keeps data alive, shares ownership with the returned weights.
+     * @param data Contents of the weight file, needs to be 64 byte aligned.
+     * @param size Size of the weight file.
+     * @param name Name of the weight file used within error messages.
+     * @param source Hash of the network file the weights need to be exported from, nullptr to accept any.
+     */
+    template<typename W>
+    std::shared_ptr<const W> viewWeights(std::shared_ptr<const void> owner, const unsigned char* data, size_t size,
+                                         const std::string& name, const uint64_t* source) {
+        auto invalid = [&name](const std::string& reason) {
+            return std::runtime_error("Invalid weight file " + name + ": " + reason);
+        };
+        if(size < WeightFileHeaderSize || std::memcmp(data, magic<W>(), sizeof(WeightFileMagic)) != 0)
+            throw invalid("not a weight file");
+        if(getLE(data + VersionOffset, 4) != WeightFileVersion)
+            throw invalid("unsupported format version");
+        for(size_t i = 0; i < sizeof(Shapes) / sizeof(Shapes[0]); i++)
+            if(getLE(data + ShapesOffset + 4 * i, 4) != Shapes[i])
+                throw invalid("network shapes do not match the inference engine");
+        if(source && getLE(data + SourceOffset, 8) != *source)
+            throw invalid("exported from another network file");
+        const uint64_t offset = getLE(data + PayloadOffsetOffset, 4);
+        const uint64_t payloadSize = getLE(data + PayloadSizeOffset, 4);
+        if(offset % 64 != 0 || payloadSize != sizeof(W) || offset > size || size - offset < payloadSize)
+            throw invalid("unexpected payload layout");
+        const unsigned char* payload = data + offset;
+        if(fnv1a(payload, payloadSize) != getLE(data + ChecksumOffset, 8))
+            throw invalid("checksum mismatch");
+
+        if(littleEndian()) {
+            // the weights point into data, which lives as long as any copy of the returned pointer
+            return std::shared_ptr<const W>(owner, reinterpret_cast<const W*>(payload));
+        }
+        auto weights = std::make_shared<W>();
+        std::memcpy(static_cast<void*>(weights.get()), payload, sizeof(W));
+        swapByteOrder(*weights);
+        return weights;
+    }
+
+    template<typename W>
+    void writeWeights(const W& w, const std::filesystem::path& file, uint64_t source) {
+        // payload in file byte order
+        auto copy = std::make_unique<W>(w);
+        if(!littleEndian())
+            swapByteOrder(*copy);
+        const unsigned char* payload = reinterpret_cast<const unsigned char*>(copy.get());
+
+        unsigned char header[WeightFileHeaderSize] = {};
+        std::memcpy(header, magic<W>(), sizeof(WeightFileMagic));
+        putLE(header + VersionOffset, WeightFileVersion, 4);
+        for(size_t i = 0; i < sizeof(Shapes) / sizeof(Shapes[0]); i++)
+            putLE(header + ShapesOffset + 4 * i, Shapes[i], 4);
+        putLE(header + PayloadOffsetOffset, WeightFileHeaderSize, 4);
+        putLE(header + PayloadSizeOffset, sizeof(W), 4);
+        putLE(header + ChecksumOffset, fnv1a(payload, sizeof(W)), 8);
+        putLE(header + SourceOffset, source, 8);
+
+        // replace the file atomically, a truncated file would crash processes mapping it
+        std::filesystem::path tmp = file;
+        tmp += ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char*>(header), sizeof(header));
+            out.write(reinterpret_cast<const char*>(payload), sizeof(W));
+            if(!out)
+                throw std::runtime_error("Unable to write weight file: " + tmp.string());
+        }
+        std::error_code ec;
+        std::filesystem::rename(tmp, file, ec);
+        if(ec) {
+            std::filesystem::remove(tmp, ec);
+            throw std::runtime_error("Unable to replace weight file: " + file.string());
+        }
+    }
+
+    template<typename W>
+    std::shared_ptr<const W> mapFile(const std::filesystem::path& file, uint64_t source) {
+        auto map = std::make_shared<MappedFile>(file);
+        return viewWeights<W>(map, map->data(), map->size(), file.string(), &source);
+    }
+}
+
+    uint64_t hashFile(const std::filesystem::path& file) {
+        std::ifstream in(file, std::ios::binary);
+        if(!in)
+            throw std::runtime_error("Unable to open file: " + file.string());
+        uint64_t hash = Fnv1aBasis;
+        std::vector<char> buffer(1 << 16);
+        while(in.read(buffer.data(), buffer.size()) || in.gcount() > 0)
+            hash = fnv1a(reinterpret_cast<const unsigned char*>(buffer.data()), static_cast<size_t>(in.gcount()), hash);
+        if(in.bad())
+            throw std::runtime_error("Unable to read file: " + file.string());
+        return hash;
+    }
+
+    void saveWeights(const Weights& w, const std::filesystem::path& file, uint64_t source) {
+        writeWeights(w, file, source);
+    }
+
+    void saveWeights(const int8::Weights& w, const std::filesystem::path& file, uint64_t source) {
+        writeWeights(w, file, source);
+    }
+
+    std::shared_ptr<const Weights> mapWeights(const std::filesystem::path& file, uint64_t source) {
+        return mapFile<Weights>(file, source);
+    }
+
+    std::shared_ptr<const int8::Weights> mapQuantizedWeights(const std::filesystem::path& file, uint64_t source) {
+        return mapFile<int8::Weights>(file, source);
+    }
+
+    std::shared_ptr<const Weights> embeddedWeights() {
+#if defined(LENET_EMBEDDED_WEIGHTS)
+        // static storage, nothing to own
+        return viewWeights<Weights>(nullptr, EmbeddedWeightFile, sizeof(EmbeddedWeightFile), "(embedded)", nullptr);
+#else
+        return nullptr;
+#endif
+    }
+
+    std::shared_ptr<const int8::Weights> embeddedQuantizedWeights() {
+#if defined(LENET_EMBEDDED_WEIGHTS)
+        return viewWeights<int8::Weights>(nullptr, EmbeddedQuantizedWeightFile, sizeof(EmbeddedQuantizedWeightFile), "(embedded int8)", nullptr);
+#else
+        return nullptr;
+#endif
+    }
+}
@@ -0,0 +1,95 @@
+/**
+ * @file LeNetWeightFile.h
+ * @brief Flat, memory mapped file format for the weights of the static and int8 inference engines.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#ifndef LENETWEIGHTFILE_H
+#define LENETWEIGHTFILE_H
+
+#include <cstdint>
+#include <memory>
+#include <filesystem>
+#include "LeNetEngine.h"
+#include "LeNetInt8.h"
+
+/**
+ * @brief Flat weight file of the static and int8 inference engines.
+ *
+ * The file holds lenet::Weights (or lenet::int8::Weights) exactly as the engine uses them, so it can be mapped
+ * into memory and used in place without parsing or copying. All processes mapping
+ * the same file share one physical copy of the weights.
+ *
+ * Layout (all integers and floats little endian):
+ * - header (WeightFileHeaderSize bytes): magic, format version, network shapes,
+ *   payload offset, payload size, FNV-1a checksum of the payload and FNV-1a hash of
+ *   the network file the weights were exported from
+ * - payload at a 64 byte aligned offset: the bytes of lenet::Weights or lenet::int8::Weights,
+ *   the magic tells them apart
+ *
+ * Big endian hosts cannot use the mapping in place, the payload is copied and byte
+ * swapped while loading instead.
+ */
+namespace lenet
+{
+    constexpr char WeightFileMagic[8] = { 'L', 'E', 'N', 'E', 'T', 'W', 'G', 'T' };
+    constexpr char QuantizedWeightFileMagic[8] = { 'L', 'E', 'N', 'E', 'T', 'I', 'N', '8' };
+    constexpr uint32_t WeightFileVersion = 2;
+    constexpr size_t WeightFileHeaderSize = 64;
+
+    /**
+     * @brief Computes the FNV-1a hash of a whole file, identifies the network a weight file was exported from.
+     * @param file File to hash.
+     * @returns Hash of the file contents.
+     * @throws std::runtime_error if the file cannot be read.
+     */
+    uint64_t hashFile(const std::filesystem::path& file);
+
+    /**
+     * @brief Writes the weights to a flat weight file. The file is written to a
+     * temporary file first and then renamed, processes still mapping the old file keep using it.
+     * @param w Weights to store.
+     * @param file Destination file.
+     * @param source Hash of the network file the weights were exported from (see hashFile).
+     * @throws std::runtime_error if the file cannot be written.
+     */
+    void saveWeights(const Weights& w, const std::filesystem::path& file, uint64_t source);
+
+    /**
+     * @brief Writes the quantized weights and their calibration to a flat weight file (see saveWeights).
+     */
+    void saveWeights(const int8::Weights& w, const std::filesystem::path& file, uint64_t source);
+
+    /**
+     * @brief Maps a flat weight file into memory.
+     * @param file Weight file written by saveWeights.
+     * @param source Hash of the current network file, weights exported from another network are rejected.
+     * @returns Weights pointing into the mapping, the file stays mapped as long as the pointer is in use.
+     * @throws std::runtime_error if the file cannot be mapped, was written by another format version,
+     * for other network shapes or from another network file, or if the checksum does not match.
+     */
+    std::shared_ptr<const Weights> mapWeights(const std::filesystem::path& file, uint64_t source);
+
+    /**
+     * @brief Maps a flat weight file holding quantized weights into memory (see mapWeights).
+     */
+    std::shared_ptr<const int8::Weights> mapQuantizedWeights(const std::filesystem::path& file, uint64_t source);
+
+    /**
+     * @brief Returns the weight file compiled into the executable by make embed (see Makefile).
+     * The network it was exported from is not checked, there is no network file next to it.
+     * @returns Weights pointing into the executable, nullptr if no weights were embedded.
+     * @throws std::runtime_error if the embedded file is invalid.
+     */
+    std::shared_ptr<const Weights> embeddedWeights();
+
+    /**
+     * @brief Returns the quantized weight file compiled into the executable by make embed (see embeddedWeights).
+     */
+    std::shared_ptr<const int8::Weights> embeddedQuantizedWeights();
+}
+
+#endif // LENETWEIGHTFILE_H
@@ -9,36 +9,601 @@
  */
 #include "MNISTLeNet.h"
 #include <iostream>
+#include <fstream>
 #include <dlib/data_io.h>
 #include <dlib/image_io.h>
 #include <dlib/gui_widgets.h>
 #include <dlib/opencv/cv_image.h>
 #include <dlib/opencv/to_open_cv.h>
-#include <opencv2/imgproc/types_c.h>
 #include <jpeglib.h>
+#include <csetjmp>
+#include "ConnectedComponents.h"
 
 using namespace giri;
 using namespace std;
 using namespace dlib;
 
-MNISTLeNet::MNISTLeNet(const std::filesystem::path& path) : m_DataSetPath(path),  m_Images(path), m_Labels(path), m_TestImages(path), m_TestLabels(path), m_NetworkFile(path), m_SyncFile(path) {
+// inference engines selectable by the engine option, the first one is the reference implementation
+static const std::vector<std::string> Engines = { "dlib", "static", "int8", "pruned", "student" };
+
+// digits at the start of the mnist test set used to calibrate the int8 engine
+static const size_t CalibrationDigits = 1000;
+
+/**
+ * @brief Loads a network stored as dlib loss network into a network without loss layer.
+ * The loss layer is read and discarded, the training network is never instantiated.
+ * @tparam LossNet Type of the stored network (dlib::add_loss_layer).
+ * @tparam Net Type of the loaded network, needs to use LossNet::subnet_type as subnet.
+ * @param file Network file written by serialize(file) << LossNet.
+ */
+template<typename LossNet, typename Net>
+static Net loadInferenceNet(const std::filesystem::path& file){
+    std::ifstream in(file, std::ios::binary);
+    if(!in)
+        throw MNISTLeNetException(std::string("Unable to open network file: ") + file.string());
+    Net net;
+    try
+    {
+        // layout of dlib::add_loss_layer: version, loss layer, subnet
+        int version = 0;
+        deserialize(version, in);
+        if(version != 1)
+            throw MNISTLeNetException(std::string("Unsupported network file: ") + file.string());
+        typename LossNet::loss_details_type loss;
+        deserialize(loss, in);
+        deserialize(net.subnet(), in);
+    }
+    catch(serialization_error& e)
+    {
+        throw MNISTLeNetException(e.what());
+    }
+    return net;
+}
+
+/**
+ * @brief Loads the first digits of a mnist data set without reading the whole files.
+ * @param imageFile Images of the data set (idx3-ubyte).
+ * @param labelFile Labels of the data set (idx1-ubyte).
+ * @param count Maximum number of digits loaded.
+ * @param images [out] 28x28 images of the digits.
+ * @param labels [out] Labels of the digits.
+ */
+static void loadMnistDigits(const std::filesystem::path& imageFile, const std::filesystem::path& labelFile, size_t count,
+                            std::vector<matrix<unsigned char>>& images, std::vector<unsigned long>& labels){
+    std::ifstream imageIn(imageFile, std::ios::binary);
+    std::ifstream labelIn(labelFile, std::ios::binary);
+    if(!imageIn || !labelIn)
+        throw MNISTLeNetException(std::string("MNIST dataset not found: ") + imageFile.string());
+    // idx header fields are big endian
+    auto field = [](std::istream& in) {
+        unsigned char b[4] = {};
+        in.read(reinterpret_cast<char*>(b), sizeof(b));
+        return uint32_t(b[0]) << 24 | uint32_t(b[1]) << 16 | uint32_t(b[2]) << 8 | uint32_t(b[3]);
+    };
+    if(field(imageIn) != 2051 || field(labelIn) != 2049)
+        throw MNISTLeNetException(std::string("Invalid MNIST dataset: ") + imageFile.string());
+    const size_t n = std::min<size_t>({ count, field(imageIn), field(labelIn) });
+    if(field(imageIn) != 28 || field(imageIn) != 28)
+        throw MNISTLeNetException(std::string("Invalid MNIST dataset: ") + imageFile.string());
+
+    images.resize(n);
+    labels.resize(n);
+    for(size_t i = 0; i < n; i++) {
+        images[i].set_size(28, 28);
+        imageIn.read(reinterpret_cast<char*>(&images[i](0, 0)), 28 * 28);
+        labels[i] = static_cast<unsigned char>(labelIn.get());
+    }
+    if(!imageIn || !labelIn)
+        throw MNISTLeNetException(std::string("Truncated MNIST dataset: ") + imageFile.string());
+}
+
+MNISTLeNet::MNISTLeNet(const std::filesystem::path& path, size_t replicas, const std::string& engine) : m_Replicas(replicas), m_Engine(engine), m_DataSetPath(path),  m_Images(path), m_Labels(path), m_TestImages(path), m_TestLabels(path), m_NetworkFile(path), m_SyncFile(path), m_WeightFile(path), m_QuantizedWeightFile(path), m_TinyNetworkFile(path), m_TinySyncFile(path), m_PrunedNetworkFile(path), m_PrunedSyncFile(path), m_StudentNetworkFile(path), m_StudentSyncFile(path) {
     m_Images.append("t10k-images-idx3-ubyte");
     m_Labels.append("t10k-labels-idx1-ubyte");
     m_TestImages.append("train-images-idx3-ubyte");
     m_TestLabels.append("train-labels-idx1-ubyte");
     m_NetworkFile.append("mnist_network.dat");
     m_SyncFile.append("mnist_sync");
-    if(!std::filesystem::exists(m_NetworkFile)){
+    m_WeightFile.append("mnist_network.weights");
+    m_QuantizedWeightFile.append("mnist_network.int8");
+    m_TinyNetworkFile.append("mnist_tiny_network.dat");
+    m_TinySyncFile.append("mnist_tiny_sync");
+    m_PrunedNetworkFile.append("mnist_pruned_network.dat");
+    m_PrunedSyncFile.append("mnist_pruned_sync");
+    m_StudentNetworkFile.append("mnist_student_network.dat");
+    m_StudentSyncFile.append("mnist_student_sync");
+    if(std::find(Engines.begin(), Engines.end(), m_Engine) == Engines.end())
+        throw MNISTLeNetException(std::string("Unknown inference engine: ") + m_Engine);
+    if(m_DataSetPath.empty()){
+        // weights compiled into the executable, there is no network file to train or load
+        if(m_Engine != "static" && m_Engine != "int8")
+            throw MNISTLeNetException("Only the static and int8 engines are available with the embedded network.");
+        m_Weights = lenet::embeddedWeights();
+        if(!m_Weights)
+            throw MNISTLeNetException("No network embedded into the executable, see make embed.");
+        std::atomic_store(&m_Backend, createBackend(m_Engine));
+    }
+    else if(!std::filesystem::exists(m_NetworkFile)){
         train();
     }
     else{
-        deserialize(m_NetworkFile.string()) >> m_Net;
+        updateInferenceNet();
     }
 }
 
-void MNISTLeNet::train(){
+MNISTLeNet::~MNISTLeNet(){
+    watch(std::chrono::seconds(0));
 
-    // check for mnist dataset
+    // fine tuning cannot be interrupted, a running derivation is finished but not started over
+    {
+        std::lock_guard<std::mutex> lock(m_DeriveMutex);
+        m_DeriveAgain = false;
+    }
+    if(m_Deriver.joinable())
+        m_Deriver.join();
+}
+
+void MNISTLeNet::updateInferenceNet(){
+    // the new backend is built completely before it replaces the serving one,
+    // the reference network and the weights of the static engines are loaded again on first use
+    {
+        std::lock_guard<std::mutex> lock(m_ReferenceMutex);
+        m_Reference.reset();
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_WeightsMutex);
+        m_Weights.reset();
+    }
+
+    // predictions in progress keep their copy of the previous backend
+    std::atomic_store(&m_Backend, createBackend(m_Engine));
+}
+
+void MNISTLeNet::reload(){
+    if(m_DataSetPath.empty())
+        throw MNISTLeNetException("The embedded network cannot be reloaded.");
+
+    std::lock_guard<std::mutex> reloadLock(m_ReloadMutex);
+
+    // pruning and distillation fine tune for minutes, an outdated derived network is recreated in the background
+    if(m_Engine == "pruned" || m_Engine == "student") {
+        {
+            std::lock_guard<std::mutex> lock(m_DeriveMutex);
+            if(m_Deriving) {
+                // the running derivation starts over once it finished, using the newest network file
+                m_DeriveAgain = true;
+                std::cout << "The " << m_Engine << " network is still being derived, it is derived again from the new network file afterwards." << std::endl;
+                return;
+            }
+        }
+        auto const& derived = m_Engine == "pruned" ? m_PrunedNetworkFile : m_StudentNetworkFile;
+        if(!std::filesystem::exists(derived) || std::filesystem::last_write_time(derived) < std::filesystem::last_write_time(m_NetworkFile)) {
+            deriveInBackground();
+            return;
+        }
+    }
+
+    std::shared_ptr<const lenet::Weights> weights;
+    {
+        std::lock_guard<std::mutex> lock(m_WeightsMutex);
+        weights = m_Weights;
+    }
+    std::shared_ptr<DlibBackend<InferenceNet>> reference;
+    {
+        std::lock_guard<std::mutex> lock(m_ReferenceMutex);
+        reference = m_Reference;
+    }
+
+    // keep serving the previous network if the new one cannot be loaded
+    auto restore = [&]() {
+        {
+            std::lock_guard<std::mutex> lock(m_WeightsMutex);
+            m_Weights = weights;
+        }
+        std::lock_guard<std::mutex> lock(m_ReferenceMutex);
+        m_Reference = reference;
+    };
+    try
+    {
+        removeStaleNetworks();
+        updateInferenceNet();
+    }
+    catch(MNISTLeNetException&)
+    {
+        restore();
+        throw;
+    }
+    catch(std::exception& e)
+    {
+        restore();
+        throw MNISTLeNetException(e.what());
+    }
+    m_Reloads++;
+}
+
+void MNISTLeNet::deriveInBackground(){
+    {
+        std::lock_guard<std::mutex> lock(m_DeriveMutex);
+        m_Deriving = true;
+    }
+    // a previous derivation already finished, m_Deriving was not set
+    if(m_Deriver.joinable())
+        m_Deriver.join();
+
+    std::cout << "Deriving the " << m_Engine << " network from the new network file in the background, the previous network is used until it is ready." << std::endl;
+    m_Deriver = std::thread([this]() {
+        for(;;) {
+            // reload() does not touch the networks while deriving, the serving backend is only replaced once the new one is ready
+            try
+            {
+                removeStaleNetworks();
+                updateInferenceNet();
+                m_Reloads++;
+                std::cout << "The " << m_Engine << " network was derived from the new network file and is used now." << std::endl;
+            }
+            catch(std::exception& e)
+            {
+                std::cout << "Deriving the " << m_Engine << " network failed, the previous network is still used: " << e.what() << std::endl;
+            }
+
+            std::lock_guard<std::mutex> lock(m_DeriveMutex);
+            if(!m_DeriveAgain) {
+                m_Deriving = false;
+                return;
+            }
+            m_DeriveAgain = false;
+        }
+    });
+}
+
+void MNISTLeNet::watch(std::chrono::seconds interval){
+    // stop the current watcher
+    {
+        std::lock_guard<std::mutex> lock(m_WatchMutex);
+        m_WatchStop = true;
+    }
+    m_WatchCv.notify_all();
+    if(m_Watcher.joinable())
+        m_Watcher.join();
+    m_WatchStop = false;
+    if(interval.count() <= 0 || m_DataSetPath.empty())
+        return;
+
+    m_Watcher = std::thread([this, interval]() {
+        std::error_code ec;
+        auto loaded = std::filesystem::last_write_time(m_NetworkFile, ec);
+        auto seen = loaded;
+        std::unique_lock<std::mutex> lock(m_WatchMutex);
+        while(!m_WatchCv.wait_for(lock, interval, [this]() { return m_WatchStop; })) {
+            auto current = std::filesystem::last_write_time(m_NetworkFile, ec);
+            if(ec || current == loaded)
+                continue;
+
+            // the file may still be written, wait until it stays unchanged for one interval
+            if(current != seen) {
+                seen = current;
+                continue;
+            }
+
+            // predictions are not blocked while loading, only stopping the watcher waits for it
+            lock.unlock();
+            try
+            {
+                reload();
+                std::cout << "Network reloaded: " << m_NetworkFile.string() << std::endl;
+            }
+            catch(MNISTLeNetException& e)
+            {
+                std::cout << "Reloading the network failed, the previous network is still used: " << e.getMessage() << std::endl;
+            }
+            lock.lock();
+
+            // a file failing to load is retried once it changes again
+            loaded = current;
+        }
+    });
+}
+
+void MNISTLeNet::removeStaleNetworks(){
+    // the pruned and student networks are derived from the trained network
+    auto network = std::filesystem::last_write_time(m_NetworkFile);
+    for(auto const& file : { m_PrunedNetworkFile, m_PrunedSyncFile, m_StudentNetworkFile, m_StudentSyncFile })
+        if(std::filesystem::exists(file) && std::filesystem::last_write_time(file) < network)
+            std::filesystem::remove(file);
+}
+
+std::shared_ptr<DlibBackend<MNISTLeNet::InferenceNet>> MNISTLeNet::reference(){
+    std::lock_guard<std::mutex> lock(m_ReferenceMutex);
+    if(!m_Reference) {
+        // load the trained network without loss layer once, predictions reuse copies of it
+        InferenceNet proto = loadInferenceNet<LeNet, InferenceNet>(m_NetworkFile);
+        m_Reference = std::make_shared<DlibBackend<InferenceNet>>("dlib", proto, m_Replicas, m_BatchSize);
+    }
+    return m_Reference;
+}
+
+std::shared_ptr<const lenet::Weights> MNISTLeNet::weights(){
+    std::lock_guard<std::mutex> lock(m_WeightsMutex);
+    if(!m_Weights)
+        m_Weights = loadWeights();
+    return m_Weights;
+}
+
+std::shared_ptr<const lenet::Weights> MNISTLeNet::loadWeights(){
+    // the flat weight file is used in place, no need to parse the network file,
+    // a file exported from another network (copied or restored files keep no reliable mtime) is replaced
+    const uint64_t source = lenet::hashFile(m_NetworkFile);
+    if(std::filesystem::exists(m_WeightFile)) {
+        try
+        {
+            return lenet::mapWeights(m_WeightFile, source);
+        }
+        catch(std::exception& e)
+        {
+            std::cout << e.what() << ", exporting it again." << std::endl;
+        }
+    }
+
+    // weights of the static engine, layer<i> counts from the output layer of the subnet
+    auto params = [](const auto& l, size_t count) {
+        const tensor& t = l.layer_details().get_layer_params();
+        if(t.size() != count)
+            throw MNISTLeNetException("Network layout does not match the static inference engine.");
+        return t.host();
+    };
+    auto weights = std::make_shared<lenet::Weights>();
+    {
+        auto reference = this->reference()->pool().checkout();
+        auto& net = reference->subnet();
+        weights->conv1.load(params(layer<10>(net), decltype(weights->conv1)::NumParams));
+        weights->conv1Bits.load(weights->conv1);
+        weights->conv2.load(params(layer<7>(net), decltype(weights->conv2)::NumParams));
+        weights->fc1.loadChannelsLast<lenet::Conv2Filters, lenet::Pool2Size, lenet::Pool2Size>(params(layer<4>(net), decltype(weights->fc1)::NumParams));
+        weights->fc2.load(params(layer<2>(net), decltype(weights->fc2)::NumParams));
+        weights->fc3.load(params(layer<0>(net), decltype(weights->fc3)::NumParams));
+    }
+
+    // a missing weight file only costs startup time
+    try
+    {
+        lenet::saveWeights(*weights, m_WeightFile, source);
+    }
+    catch(std::exception& e)
+    {
+        std::cout << e.what() << std::endl;
+    }
+    return weights;
+}
+
+InferenceBackend::SPtr MNISTLeNet::createBackend(const std::string& engine){
+    if(engine == "dlib")
+        return reference();
+    if(engine == "static")
+        return std::make_shared<StaticBackend>(weights(), m_BatchSize);
+    if(engine == "int8")
+        return std::make_shared<Int8Backend>(loadQuantizedWeights());
+    if(engine == "pruned")
+        return std::make_shared<PrunedBackend>(loadPrunedNet());
+    if(engine == "student")
+        return loadStudentNet();
+    throw MNISTLeNetException(std::string("Unknown inference engine: ") + engine);
+}
+
+InferenceBackend::SPtr MNISTLeNet::loadStudentNet(){
+    // the student is distilled once from the trained network and stored next to it
+    if(!std::filesystem::exists(m_StudentNetworkFile))
+        distill();
+    StudentInferenceNet proto = loadInferenceNet<StudentNet, StudentInferenceNet>(m_StudentNetworkFile);
+    return std::make_shared<DlibBackend<StudentInferenceNet>>("student", proto, m_Replicas, m_BatchSize);
+}
+
+void MNISTLeNet::distill(){
+    checkDataSet();
+
+    // delete existing network if existent
+    if(std::filesystem::exists(m_StudentNetworkFile)){
+        std::filesystem::remove(m_StudentNetworkFile);
+    }
+
+    try
+    {
+        std::vector<matrix<unsigned char>> training_images;
+        std::vector<unsigned long>         training_labels;
+        std::vector<matrix<unsigned char>> testing_images;
+        std::vector<unsigned long>         testing_labels;
+        load_mnist_dataset(m_DataSetPath.string(), training_images, training_labels, testing_images, testing_labels);
+
+        // soft targets: teacher outputs softened by the temperature, blended with the true labels.
+        // layer<1> of the inference network is the last fc layer (outputs before the softmax)
+        const float temperature = 4.0f;
+        std::vector<matrix<float, 0, 1>> targets;
+        targets.reserve(training_images.size());
+        {
+            auto net = reference()->pool().checkout();
+            for(size_t first = 0; first < training_images.size(); first += m_BatchSize) {
+                size_t last = std::min(first + m_BatchSize, training_images.size());
+                (*net)(training_images.begin() + first, training_images.begin() + last);
+                matrix<float> logits = mat(layer<1>(*net).get_output());
+                for(long r = 0; r < logits.nr(); r++) {
+                    matrix<float, 0, 1> soft = trans(rowm(logits, r)) / temperature;
+                    soft = exp(soft - dlib::max(soft));
+                    soft = m_SoftTargetWeight * soft / sum(soft);
+                    soft(training_labels[first + r]) += 1.0f - m_SoftTargetWeight;
+                    targets.push_back(soft);
+                }
+            }
+        }
+
+        DistillNet distillNet;
+        distillNet.loss_details() = loss_distill_(temperature);
+        dnn_trainer<DistillNet> trainer(distillNet);
+        trainer.set_learning_rate(0.01);
+        trainer.set_min_learning_rate(0.00001);
+        trainer.set_mini_batch_size(128);
+        trainer.be_verbose();
+        trainer.set_synchronization_file(m_StudentSyncFile.string(), std::chrono::seconds(20));
+        trainer.train(training_images, targets);
+
+        // the student is stored as a regular classifier
+        StudentNet student;
+        student.subnet() = distillNet.subnet();
+        student.clean();
+
+        // compare accuracy of student and teacher on the test set
+        size_t studentCorrect = 0;
+        size_t teacherCorrect = 0;
+        std::vector<unsigned long> studentLabels = student(testing_images);
+        auto teacherProbs = reference()->classify(testing_images);
+        for(size_t i = 0; i < testing_images.size(); i++) {
+            studentCorrect += studentLabels[i] == testing_labels[i];
+            teacherCorrect += static_cast<unsigned long>(index_of_max(teacherProbs[i])) == testing_labels[i];
+        }
+        double studentAcc = 100.0 * studentCorrect / testing_images.size();
+        double teacherAcc = 100.0 * teacherCorrect / testing_images.size();
+        std::cout << "Student network accuracy: " << studentAcc << "%, teacher network accuracy: " << teacherAcc 
+                  << "%, delta: " << (studentAcc - teacherAcc) << "%" << std::endl;
+        if(teacherAcc - studentAcc > m_StudentMaxAccuracyLoss)
+            throw MNISTLeNetException("Student network accuracy is more than " + std::to_string(m_StudentMaxAccuracyLoss) + "% below the teacher.");
+
+        serialize(m_StudentNetworkFile.string()) << student;
+    }
+    catch(MNISTLeNetException&)
+    {
+        removeStudentSyncFiles();
+        throw;
+    }
+    catch(std::exception& e)
+    {
+        removeStudentSyncFiles();
+        throw MNISTLeNetException(e.what());
+    }
+}
+
+void MNISTLeNet::removeStudentSyncFiles(){
+    // a retry would resume from the state that failed, dlib keeps a second copy of the sync file with a trailing _
+    for(auto const& file : { m_StudentSyncFile, std::filesystem::path(m_StudentSyncFile.string() + "_") }) {
+        std::error_code ec;
+        std::filesystem::remove(file, ec);
+    }
+}
+
+std::shared_ptr<const lenet::pruned::Weights> MNISTLeNet::loadPrunedNet(){
+    // the compacted network is created once after training and stored next to the dense one
+    LeNet compact;
+    if(!std::filesystem::exists(m_PrunedNetworkFile))
+        prune();
+    deserialize(m_PrunedNetworkFile.string()) >> compact;
+
+    // layer widths of the compacted network, layer<i> counts from the output layer of the subnet
+    auto& net = compact.subnet();
+    const size_t c1 = layer<10>(net).layer_details().num_filters();
+    const size_t c2 = layer<7>(net).layer_details().num_filters();
+    const size_t n1 = layer<4>(net).layer_details().get_num_outputs();
+    const size_t n2 = layer<2>(net).layer_details().get_num_outputs();
+    const size_t k2 = lenet::FilterSize * lenet::FilterSize;
+    if(c1 < 1 || c1 > lenet::Conv1Filters || c2 < 1 || c2 > lenet::Conv2Filters || 
+       n1 < 1 || n1 > lenet::Fc1Outputs || n2 < 1 || n2 > lenet::Fc2Outputs)
+        throw MNISTLeNetException("Pruned network is wider than LeNet.");
+    auto params = [](const auto& l, size_t count) {
+        const tensor& t = l.layer_details().get_layer_params();
+        if(t.size() != count)
+            throw MNISTLeNetException("Network layout does not match the pruned inference engine.");
+        return t.host();
+    };
+    auto weights = std::make_shared<lenet::pruned::Weights>();
+    weights->conv1.load(params(layer<10>(net), c1 * k2 + c1), 1, c1);
+    weights->conv2.load(params(layer<7>(net), c2 * c1 * k2 + c2), c1, c2);
+    weights->fc1.loadChannelsLast(params(layer<4>(net), c2 * lenet::Pool2Size * lenet::Pool2Size * n1 + n1), 
+                                  c2, weights->conv2.outStride, lenet::Pool2Size * lenet::Pool2Size, n1);
+    weights->fc2.load(params(layer<2>(net), n1 * n2 + n2), n1, n2);
+    weights->fc3.load(params(layer<0>(net), n2 * lenet::Labels + lenet::Labels), n2, lenet::Labels);
+    const size_t denseParams = decltype(lenet::Weights::conv1)::NumParams + decltype(lenet::Weights::conv2)::NumParams +
+                               decltype(lenet::Weights::fc1)::NumParams + decltype(lenet::Weights::fc2)::NumParams +
+                               decltype(lenet::Weights::fc3)::NumParams;
+    std::cout << "Pruned network parameters: " << weights->parameters() << ", LeNet parameters: " << denseParams << std::endl;
+    return weights;
+}
+
+void MNISTLeNet::prune(){
+    checkDataSet();
+
+    using namespace lenet;
+    LeNet compact;
+    {
+        // remove the filters and neurons with the smallest L1 norms, the output layer is kept as it is
+        auto params = [](const auto& l) { return l.layer_details().get_layer_params().host(); };
+        auto reference = this->reference()->pool().checkout();
+        auto& dense = reference->subnet();
+        auto keep = [this](size_t n) { return static_cast<size_t>(std::lround(n * (1.0 - m_PruneFraction))); };
+        const std::vector<size_t> input = { 0 };
+        std::vector<size_t> labels(Labels);
+        std::iota(labels.begin(), labels.end(), 0);
+        auto keepC1 = pruned::strongest(pruned::filterNorms(params(layer<10>(dense)), 1, Conv1Filters, FilterSize), keep(Conv1Filters));
+        auto keepC2 = pruned::strongest(pruned::filterNorms(params(layer<7>(dense)), Conv1Filters, Conv2Filters, FilterSize), keep(Conv2Filters));
+        auto keepN1 = pruned::strongest(pruned::neuronNorms(params(layer<4>(dense)), Features, Fc1Outputs), keep(Fc1Outputs));
+        auto keepN2 = pruned::strongest(pruned::neuronNorms(params(layer<2>(dense)), Fc1Outputs, Fc2Outputs), keep(Fc2Outputs));
+
+        // compacted network of the same type with fewer filters and neurons,
+        // one forward pass allocates the parameter tensors which are then replaced by the remaining weights
+        auto& net = compact.subnet();
+        layer<10>(net).layer_details().set_num_filters(keepC1.size());
+        layer<7>(net).layer_details().set_num_filters(keepC2.size());
+        layer<4>(net).layer_details().set_num_outputs(keepN1.size());
+        layer<2>(net).layer_details().set_num_outputs(keepN2.size());
+        compact(matrix<unsigned char>(zeros_matrix<unsigned char>(m_ImgSize, m_ImgSize)));
+        auto assign = [](auto& l, const std::vector<float>& values) {
+            tensor& t = l.layer_details().get_layer_params();
+            if(t.size() != values.size())
+                throw MNISTLeNetException("Pruned network layout does not match the remaining weights.");
+            std::copy(values.begin(), values.end(), t.host());
+        };
+        assign(layer<10>(net), pruned::compactConv(params(layer<10>(dense)), 1, Conv1Filters, FilterSize, input, keepC1));
+        assign(layer<7>(net), pruned::compactConv(params(layer<7>(dense)), Conv1Filters, Conv2Filters, FilterSize, keepC1, keepC2));
+        assign(layer<4>(net), pruned::compactFc(params(layer<4>(dense)), Features, Fc1Outputs, pruned::expandChannels(keepC2, Pool2Size * Pool2Size), keepN1));
+        assign(layer<2>(net), pruned::compactFc(params(layer<2>(dense)), Fc1Outputs, Fc2Outputs, keepN1, keepN2));
+        assign(layer<0>(net), pruned::compactFc(params(layer<0>(dense)), Fc2Outputs, Labels, keepN2, labels));
+    }
+
+    try
+    {
+        std::vector<matrix<unsigned char>> training_images;
+        std::vector<unsigned long>         training_labels;
+        std::vector<matrix<unsigned char>> testing_images;
+        std::vector<unsigned long>         testing_labels;
+        load_mnist_dataset(m_DataSetPath.string(), training_images, training_labels, testing_images, testing_labels);
+
+        // fine tune the remaining weights, starting with a smaller learning rate than training from scratch
+        dnn_trainer<LeNet> trainer(compact);
+        trainer.set_learning_rate(0.001);
+        trainer.set_min_learning_rate(0.00001);
+        trainer.set_mini_batch_size(128);
+        trainer.be_verbose();
+        trainer.set_synchronization_file(m_PrunedSyncFile.string(), std::chrono::seconds(20));
+        trainer.train(training_images, training_labels);
+
+        // save compacted network to disk
+        compact.clean();
+        serialize(m_PrunedNetworkFile.string()) << compact;
+
+        // report accuracy of the compacted network compared to the dense network
+        size_t prunedCorrect = 0;
+        size_t denseCorrect = 0;
+        std::vector<unsigned long> prunedLabels = compact(testing_images);
+        auto denseProbs = reference()->classify(testing_images);
+        for(size_t i = 0; i < testing_images.size(); i++) {
+            prunedCorrect += prunedLabels[i] == testing_labels[i];
+            denseCorrect += static_cast<unsigned long>(index_of_max(denseProbs[i])) == testing_labels[i];
+        }
+        std::cout << "Pruned network accuracy: " << 100.0 * prunedCorrect / testing_images.size() << "%, dense network accuracy: " 
+                  << 100.0 * denseCorrect / testing_images.size() << "%" << std::endl;
+    }
+    catch(std::exception& e)
+    {
+        throw MNISTLeNetException(e.what());
+    }
+}
+
+void MNISTLeNet::checkDataSet() const {
     if(!std::filesystem::exists(m_Images) || 
        !std::filesystem::exists(m_Labels) ||
        !std::filesystem::exists(m_TestImages) ||
@@ -46,11 +611,351 @@ void MNISTLeNet::train(){
     ){
         throw MNISTLeNetException(std::string("MNIST dataset not found within: ") + m_DataSetPath.string());
     }
+}
+
+std::shared_ptr<const lenet::int8::Weights> MNISTLeNet::loadQuantizedWeights(){
+    if(m_DataSetPath.empty()) {
+        auto weights = lenet::embeddedQuantizedWeights();
+        if(!weights)
+            throw MNISTLeNetException("No network embedded into the executable, see make embed.");
+        return weights;
+    }
+
+    // calibrated once per network like the weight file of the static engine, restarts and reloads map the stored result
+    const uint64_t source = lenet::hashFile(m_NetworkFile);
+    if(std::filesystem::exists(m_QuantizedWeightFile)) {
+        try
+        {
+            return lenet::mapQuantizedWeights(m_QuantizedWeightFile, source);
+        }
+        catch(std::exception& e)
+        {
+            std::cout << e.what() << ", calibrating again." << std::endl;
+        }
+    }
+    auto weights = quantize();
+
+    // a missing weight file only costs startup time
+    try
+    {
+        lenet::saveWeights(*weights, m_QuantizedWeightFile, source);
+    }
+    catch(std::exception& e)
+    {
+        std::cout << e.what() << std::endl;
+    }
+    return weights;
+}
+
+std::shared_ptr<const lenet::int8::Weights> MNISTLeNet::quantize(){
+    std::vector<matrix<unsigned char>> testing_images;
+    std::vector<unsigned long>         testing_labels;
+    loadMnistDigits(m_Images, m_Labels, CalibrationDigits, testing_images, testing_labels);
+
+    // calibrate activation ranges by running a fixed subset of the test set through the float network,
+    // layer<i> counts from the softmax layer of the inference network
+    lenet::Calibration cal;
+    size_t floatCorrect = 0;
+    {
+        auto net = reference()->pool().checkout();
+        for(size_t first = 0; first < testing_images.size(); first += m_BatchSize) {
+            size_t last = std::min(first + m_BatchSize, testing_images.size());
+            matrix<float> p = mat((*net)(testing_images.begin() + first, testing_images.begin() + last));
+            cal.pool1 = std::max(cal.pool1, dlib::max(mat(layer<9>(*net).get_output())));
+            cal.pool2 = std::max(cal.pool2, dlib::max(mat(layer<6>(*net).get_output())));
+            cal.fc1 = std::max(cal.fc1, dlib::max(mat(layer<4>(*net).get_output())));
+            cal.fc2 = std::max(cal.fc2, dlib::max(mat(layer<2>(*net).get_output())));
+            for(long r = 0; r < p.nr(); r++)
+                if(static_cast<unsigned long>(index_of_max(rowm(p, r))) == testing_labels[first + r])
+                    floatCorrect++;
+        }
+    }
+    auto weights = std::make_shared<lenet::int8::Weights>();
+    weights->quantize(*this->weights(), cal);
+
+    // report accuracy of the quantized network compared to the float network
+    size_t int8Correct = 0;
+    for(size_t i = 0; i < testing_images.size(); i++) {
+        matrix<float, 1, 10> p;
+        lenet::int8::predict(*weights, &testing_images[i](0, 0), &p(0));
+        if(static_cast<unsigned long>(index_of_max(p)) == testing_labels[i])
+            int8Correct++;
+    }
+    double floatAcc = 100.0 * floatCorrect / testing_images.size();
+    double int8Acc = 100.0 * int8Correct / testing_images.size();
+    std::cout << "INT8 network accuracy: " << int8Acc << "%, float network accuracy: " << floatAcc 
+              << "%, delta: " << (int8Acc - floatAcc) << "%" << std::endl;
+    return weights;
+}
+
+json::JSON MNISTLeNet::statistics() const {
+    json::JSON stats;
+    // the serving backend is only replaced once a reloaded network is ready
+    auto backend = std::atomic_load(&m_Backend);
+    stats["engine"] = backend->name();
+    auto replicas = backend->replicaStats();
+    if(replicas.replicas > 0) {
+        stats["replicas"] = replicas.replicas;
+        stats["checkouts"] = replicas.checkouts;
+        stats["waits"] = replicas.waits;
+    }
+    if(m_CascadeThreshold > 0) {
+        stats["tiny_answers"] = m_TinyAnswers.load();
+        stats["lenet_answers"] = m_FullAnswers.load();
+    }
+    stats["reloads"] = m_Reloads.load();
+    if(m_Shadow) {
+        stats["shadow_digits"] = m_Shadow->compared();
+        stats["shadow_dropped"] = m_Shadow->dropped();
+        stats["shadow_agreement"] = m_Shadow->agreement();
+        stats["shadow_confidence_shift"] = m_Shadow->confidenceShift();
+        stats["shadow_latency_us"] = m_Shadow->latency();
+    }
+    if(m_Scheduler) {
+        stats["batches"] = m_Scheduler->batches();
+        stats["batched_requests"] = m_Scheduler->requests();
+    }
+    return stats;
+}
+
+void MNISTLeNet::exportWeights(){
+    if(m_DataSetPath.empty())
+        throw MNISTLeNetException("The embedded network cannot be exported.");
+
+    // both are written on first use if missing or exported from another network
+    weights();
+    loadQuantizedWeights();
+}
+
+InferenceBackend::SPtr MNISTLeNet::backend(const std::string& engine){
+    if(engine == m_Engine)
+        return std::atomic_load(&m_Backend);
+    return createBackend(engine);
+}
+
+json::JSON MNISTLeNet::benchmark(){
+    checkDataSet();
+
+    std::vector<matrix<unsigned char>> training_images;
+    std::vector<unsigned long>         training_labels;
+    std::vector<matrix<unsigned char>> testing_images;
+    std::vector<unsigned long>         testing_labels;
+    load_mnist_dataset(m_DataSetPath.string(), training_images, training_labels, testing_images, testing_labels);
+
+    // the test set split into batches as classified by predict, and the digits used to measure latency
+    std::vector<InferenceBackend::Digits> batches;
+    for(size_t first = 0; first < testing_images.size(); first += m_BatchSize)
+        batches.emplace_back(testing_images.begin() + first, testing_images.begin() + std::min(first + m_BatchSize, testing_images.size()));
+    std::vector<InferenceBackend::Digits> singles;
+    for(size_t i = 0; i < std::min<size_t>(1000, testing_images.size()); i++)
+        singles.push_back({ testing_images[i] });
+
+    json::JSON results = json::Array();
+    for(auto const& engine : Engines) {
+        // pruned and student networks are not created just for the benchmark, this would need a training run
+        if(engine != m_Engine && ((engine == "pruned" && !std::filesystem::exists(m_PrunedNetworkFile)) ||
+                                  (engine == "student" && !std::filesystem::exists(m_StudentNetworkFile)))) {
+            std::cout << engine << ": skipped, network not found." << std::endl;
+            continue;
+        }
+        InferenceBackend::SPtr backend = this->backend(engine);
+
+        // accuracy and throughput, whole test set
+        size_t correct = 0;
+        auto start = std::chrono::steady_clock::now();
+        size_t n = 0;
+        for(auto const& batch : batches)
+            for(auto const& p : backend->classify(batch))
+                correct += static_cast<unsigned long>(index_of_max(p)) == testing_labels[n++];
+        std::chrono::duration<double> batched = std::chrono::steady_clock::now() - start;
+
+        // latency, one digit per call
+        start = std::chrono::steady_clock::now();
+        for(auto const& single : singles)
+            backend->classify(single);
+        std::chrono::duration<double, std::micro> latency = std::chrono::steady_clock::now() - start;
+
+        double accuracy = 100.0 * correct / testing_images.size();
+        double latencyPerDigit = latency.count() / singles.size();
+        double throughput = testing_images.size() / batched.count();
+        std::cout << engine << ": accuracy " << accuracy << "%, latency " << latencyPerDigit 
+                  << " us/digit, throughput " << throughput << " digits/s" << std::endl;
+        json::JSON res;
+        res["engine"] = engine;
+        res["accuracy"] = accuracy;
+        res["latency_us"] = latencyPerDigit;
+        res["throughput"] = throughput;
+        results.append(res);
+    }
+    return results;
+}
+
+void MNISTLeNet::setBatching(size_t maxBatch, std::chrono::microseconds maxWait) {
+    m_Scheduler.reset();
+    if(maxBatch > 0)
+        m_Scheduler = std::make_unique<BatchScheduler>(maxBatch, maxWait, m_Replicas);
+}
+
+void MNISTLeNet::setWorkingSize(size_t workingSize) {
+    m_WorkingSize = workingSize;
+}
+
+void MNISTLeNet::setWorkers(size_t threads) {
+    m_Pool.reset();
+    if(threads > 0)
+        m_Pool = std::make_unique<WorkerPool>(threads);
+}
+
+void MNISTLeNet::setVoting(std::chrono::milliseconds budget) {
+    m_VoteBudget = budget;
+}
+
+std::future<InferenceBackend::Probabilities> MNISTLeNet::classifyVariants(const InferenceBackend::Digits& digits,
+                                                                          InferenceBackend::SPtr backend,
+                                                                          std::chrono::steady_clock::time_point deadline){
+    // affine transforms of the 28x28 digits: one pixel shifts and slight scales around the center
+    std::vector<cv::Mat> transforms;
+    for(auto shift : { cv::Point2d(1, 0), cv::Point2d(-1, 0), cv::Point2d(0, 1), cv::Point2d(0, -1) })
+        transforms.push_back((cv::Mat_<double>(2, 3) << 1, 0, shift.x, 0, 1, shift.y));
+    for(double scale : { 0.9, 1.1 })
+        transforms.push_back(cv::getRotationMatrix2D(cv::Point2f(m_ImgSize / 2.0f, m_ImgSize / 2.0f), 0, scale));
+
+    // all variants are classified by one task in one batch, so a voting request occupies at most one worker,
+    // on the background replicas of the backend, so the regular passes of all requests never wait for it
+    auto source = std::make_shared<const InferenceBackend::Digits>(digits);
+    return m_Pool->submit([source, backend, deadline, transforms]() {
+        // the request does not wait for variants started after the deadline
+        if(std::chrono::steady_clock::now() >= deadline)
+            return InferenceBackend::Probabilities();
+        InferenceBackend::Digits variants(transforms.size() * source->size());
+        for(size_t v = 0; v < transforms.size(); v++)
+            for(size_t i = 0; i < source->size(); i++) {
+                auto const& digit = (*source)[i];
+                auto& variant = variants[v * source->size() + i];
+                variant.set_size(digit.nr(), digit.nc());
+                cv::Mat src(digit.nr(), digit.nc(), CV_8UC1, const_cast<unsigned char*>(&digit(0, 0)));
+                cv::Mat dst(digit.nr(), digit.nc(), CV_8UC1, &variant(0, 0));
+                cv::warpAffine(src, dst, transforms[v], dst.size(), cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar(0));
+            }
+        return backend->classifyBackground(variants);
+    });
+}
+
+void MNISTLeNet::setShadow(const std::filesystem::path& candidate, double fraction) {
+    m_Shadow.reset();
+    if(candidate.empty() || fraction <= 0)
+        return;
+
+    // a single replica, the candidate runs on one background thread
+    auto backend = std::make_shared<DlibBackend<InferenceNet>>("candidate", loadInferenceNet<LeNet, InferenceNet>(candidate), 1, m_BatchSize);
+    m_Shadow = std::make_unique<ShadowEvaluator>([backend](const ShadowEvaluator::Digits& digits){
+        return backend->classify(digits);
+    }, fraction, m_ShadowMaxQueued);
+}
+
+void MNISTLeNet::setCascade(float threshold) {
+    m_CascadeThreshold = 0;
+    if(threshold <= 0)
+        return;
+    // TinyNet is trained from the mnist labels on its own, it does not depend on the LeNet in use
+    bool loaded = false;
+    if(std::filesystem::exists(m_TinyNetworkFile)) {
+        try
+        {
+            updateTinyNet();
+            loaded = true;
+        }
+        catch(std::exception& e)
+        {
+            std::cout << "Loading the tiny network failed, training a new one: " << e.what() << std::endl;
+        }
+    }
+    if(!loaded)
+        trainTiny();
+    m_CascadeThreshold = threshold;
+}
+
+void MNISTLeNet::updateTinyNet(){
+    TinyInferenceNet proto = loadInferenceNet<TinyNet, TinyInferenceNet>(m_TinyNetworkFile);
+    m_Tiny = std::make_shared<DlibBackend<TinyInferenceNet>>("tiny", proto, m_Replicas, m_BatchSize);
+}
+
+void MNISTLeNet::trainTiny(){
+
+    // check for mnist dataset
+    checkDataSet();
 
     // delete existing network if existent
+    if(std::filesystem::exists(m_TinyNetworkFile)){
+        std::filesystem::remove(m_TinyNetworkFile);
+    }
+
+    try
+    {
+        std::vector<matrix<unsigned char>> training_images;
+        std::vector<unsigned long>         training_labels;
+        std::vector<matrix<unsigned char>> testing_images;
+        std::vector<unsigned long>         testing_labels;
+        load_mnist_dataset(m_DataSetPath.string(), training_images, training_labels, testing_images, testing_labels);
+
+        // same training parameters as used for LeNet
+        TinyNet net;
+        dnn_trainer<TinyNet> trainer(net);
+        trainer.set_learning_rate(0.01);
+        trainer.set_min_learning_rate(0.00001);
+        trainer.set_mini_batch_size(128);
+        trainer.be_verbose();
+        trainer.set_synchronization_file(m_TinySyncFile.string(), std::chrono::seconds(20));
+        trainer.train(training_images, training_labels);
+
+        // save trained network to disk
+        net.clean();
+        serialize(m_TinyNetworkFile.string()) << net;
+        updateTinyNet();
+
+        // report accuracy of the tiny network on the test set
+        size_t correct = 0;
+        auto probs = m_Tiny->classify(testing_images);
+        for(size_t i = 0; i < probs.size(); i++)
+            if(static_cast<unsigned long>(index_of_max(probs[i])) == testing_labels[i])
+                correct++;
+        std::cout << "Tiny network accuracy: " << 100.0 * correct / testing_images.size() << "%" << std::endl;
+    }
+    catch(std::exception& e)
+    {
+        throw MNISTLeNetException(e.what());
+    }
+}
+
+void MNISTLeNet::train(){
+
+    // check for mnist dataset
+    checkDataSet();
+
+    // delete existing network if existent, the pruned network is derived from it
     if(std::filesystem::exists(m_NetworkFile)){
         std::filesystem::remove(m_NetworkFile);
     }
+    if(std::filesystem::exists(m_PrunedNetworkFile)){
+        std::filesystem::remove(m_PrunedNetworkFile);
+    }
+    if(std::filesystem::exists(m_PrunedSyncFile)){
+        std::filesystem::remove(m_PrunedSyncFile);
+    }
+    if(std::filesystem::exists(m_StudentNetworkFile)){
+        std::filesystem::remove(m_StudentNetworkFile);
+    }
+    if(std::filesystem::exists(m_StudentSyncFile)){
+        std::filesystem::remove(m_StudentSyncFile);
+    }
+
+    // the tiny network of the cascade is trained together with LeNet, an old one is never reused
+    if(std::filesystem::exists(m_TinyNetworkFile)){
+        std::filesystem::remove(m_TinyNetworkFile);
+    }
+    if(std::filesystem::exists(m_TinySyncFile)){
+        std::filesystem::remove(m_TinySyncFile);
+    }
 
     try
     {
@@ -64,7 +969,8 @@ void MNISTLeNet::train(){
 
         // train LeNet it using the MNIST data. The code below uses mini-batch stochastic
         // gradient descent with an initial learning rate of 0.01 to accomplish this.
-        dnn_trainer<LeNet> trainer(m_Net);
+        LeNet net;
+        dnn_trainer<LeNet> trainer(net);
         trainer.set_learning_rate(0.01);
         trainer.set_min_learning_rate(0.00001);
         trainer.set_mini_batch_size(128);
@@ -76,86 +982,156 @@ void MNISTLeNet::train(){
         trainer.train(training_images, training_labels);
 
         // save trained network to disk
-        m_Net.clean();
-        serialize(m_NetworkFile.string()) << m_Net;
+        net.clean();
+        serialize(m_NetworkFile.string()) << net;
+        updateInferenceNet();
     }
     catch(std::exception& e)
     {
         throw MNISTLeNetException(e.what());
     }
+
+    // retrain the first stage of the cascade right away if it is in use, otherwise setCascade() trains it
+    if(m_CascadeThreshold > 0)
+        trainTiny();
 }
 
 // See: https://answers.opencv.org/question/75510/how-to-make-auto-adjustmentsbrightness-and-contrast-for-image-android-opencv-image-correction/?answer=75797#post-id-75797)
-void MNISTLeNet::BrightnessAndContrastAuto(const cv::Mat &src, cv::Mat &dst, float clipHistPercent)
+void MNISTLeNet::binarizeAuto(const cv::Mat &gray, cv::Mat &bin, float clipHistPercent, int threshold)
 {
-
     CV_Assert(clipHistPercent >= 0);
-    CV_Assert((src.type() == CV_8UC1) || (src.type() == CV_8UC3) || (src.type() == CV_8UC4));
-
-    int histSize = 256;
-    float alpha, beta;
-    double minGray = 0, maxGray = 0;
-
-    //to calculate grayscale histogram
-    cv::Mat gray;
-    if (src.type() == CV_8UC1) gray = src;
-    else if (src.type() == CV_8UC3) cvtColor(src, gray, CV_BGR2GRAY);
-    else if (src.type() == CV_8UC4) cvtColor(src, gray, CV_BGRA2GRAY);
-    if (clipHistPercent == 0)
-    {
-        // keep full available range
-        cv::minMaxLoc(gray, &minGray, &maxGray);
+    CV_Assert(gray.type() == CV_8UC1);
+    const int histSize = 256;
+
+    // histogram of a regular subsample, the cut points only need the distribution of the gray values
+    const size_t step = std::max<size_t>(1, static_cast<size_t>(std::sqrt(static_cast<double>(gray.total()) / m_HistogramSamples)));
+    std::vector<float> accumulator(histSize, 0);
+    for(int y = 0; y < gray.rows; y += step) {
+        const unsigned char* row = gray.ptr<unsigned char>(y);
+        for(int x = 0; x < gray.cols; x += step)
+            accumulator[row[x]]++;
     }
-    else
-    {
-        cv::Mat hist; //the grayscale histogram
-
-        float range[] = { 0, 256 };
-        const float* histRange = { range };
-        bool uniform = true;
-        bool accumulate = false;
-        calcHist(&gray, 1, 0, cv::Mat (), hist, 1, &histSize, &histRange, uniform, accumulate);
-
-        // calculate cumulative distribution from the histogram
-        std::vector<float> accumulator(histSize);
-        accumulator[0] = hist.at<float>(0);
-        for (int i = 1; i < histSize; i++)
-        {
-            accumulator[i] = accumulator[i - 1] + hist.at<float>(i);
-        }
 
-        // locate points that cuts at required value
-        float max = accumulator.back();
-        clipHistPercent *= (max / 100.0); //make percent as absolute
-        clipHistPercent /= 2.0; // left and right wings
-        // locate left cut
-        minGray = 0;
-        while (accumulator[minGray] < clipHistPercent)
-            minGray++;
+    // calculate cumulative distribution from the histogram
+    for(int i = 1; i < histSize; i++)
+        accumulator[i] += accumulator[i - 1];
 
-        // locate right cut
-        maxGray = histSize - 1;
-        while (accumulator[maxGray] >= (max - clipHistPercent))
+    // locate points that cut at the required value, or keep the full available range
+    int minGray = 0;
+    int maxGray = histSize - 1;
+    float max = accumulator.back();
+    float clip = clipHistPercent * (max / 100.0) / 2.0; // left and right wings
+    if(clipHistPercent == 0) {
+        while(minGray < histSize - 1 && accumulator[minGray] == 0)
+            minGray++;
+        while(maxGray > 0 && accumulator[maxGray - 1] == max)
+            maxGray--;
+    }
+    else {
+        while(minGray < histSize - 1 && accumulator[minGray] < clip)
+            minGray++;
+        while(maxGray > 0 && accumulator[maxGray] >= (max - clip))
             maxGray--;
     }
 
-    // current range
-    float inputRange = maxGray - minGray;
-
-    alpha = (histSize - 1) / inputRange;   // alpha expands current range to histsize range
-    beta = -minGray * alpha;             // beta shifts current range so that minGray will go to 0
+    // alpha expands the current range to the histogram range, beta shifts minGray to 0
+    float inputRange = std::max(maxGray - minGray, 1);
+    float alpha = (histSize - 1) / inputRange;
+    float beta = -minGray * alpha;
 
-    // Apply brightness and contrast normalization
-    // convertTo operates with saurate_cast
-    src.convertTo(dst, -1, alpha, beta);
+    // contrast normalization and inverted binary threshold folded into one table,
+    // cv::LUT maps the whole image in a single vectorized pass without intermediate images
+    cv::Mat lut(1, histSize, CV_8U);
+    for(int i = 0; i < histSize; i++)
+        lut.at<unsigned char>(i) = cv::saturate_cast<unsigned char>(i * alpha + beta) > threshold ? 0 : 255;
+    cv::LUT(gray, lut, bin);
+}
 
-    // restore alpha channel from source 
-    if (dst.type() == CV_8UC4)
+namespace
+{
+    // libjpeg error manager jumping back to from_jpeg instead of exiting the process
+    struct JpegError
     {
-        int from_to[] = { 3, 3};
-        cv::mixChannels(&src, 4, &dst,1, from_to, 1);
+        jpeg_error_mgr mgr;
+        jmp_buf jump;
+        char message[JMSG_LENGTH_MAX];
+    };
+
+    void onJpegError(j_common_ptr cinfo) {
+        JpegError* err = reinterpret_cast<JpegError*>(cinfo->err);
+        (*cinfo->err->format_message)(cinfo, err->message);
+        longjmp(err->jump, 1);
     }
-    return;
+}
+
+unsigned int MNISTLeNet::from_jpeg(const Blob& b, array2d<rgb_pixel>* img, array2d<unsigned char>& img_gray) {
+    struct jpeg_decompress_struct cinfo;
+    JpegError jerr;
+    cinfo.err = jpeg_std_error(&jerr.mgr);
+    jerr.mgr.error_exit = onJpegError;
+    if(setjmp(jerr.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        throw MNISTLeNetException(std::string("Unable to decode jpeg: ") + jerr.message);
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char*)b.data(), b.size());
+    jpeg_read_header(&cinfo, TRUE);
+
+    // factor the grayscale image is scaled down by, every libjpeg version supports 1/2, 1/4 and 1/8
+    unsigned int scale = 1;
+    const size_t longer = std::max(cinfo.image_width, cinfo.image_height);
+    while(m_WorkingSize > 0 && scale < 8 && longer / (scale * 2) >= m_WorkingSize)
+        scale *= 2;
+
+    // both images are scaled down within the DCT while decoding
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = scale;
+
+    // the grayscale image is the decoded luminance whether a color image is requested or not, so predictions do not
+    // depend on it; libjpeg skips color conversion if only the luminance is needed. Pictures stored in other color
+    // spaces (RGB, CMYK) are decoded to RGB and converted in both cases.
+    const bool luminance = cinfo.jpeg_color_space == JCS_YCbCr || cinfo.jpeg_color_space == JCS_GRAYSCALE;
+    if(!luminance)
+        cinfo.out_color_space = JCS_RGB;
+    else if(img && cinfo.jpeg_color_space == JCS_YCbCr)
+        cinfo.out_color_space = JCS_YCbCr;
+    else
+        cinfo.out_color_space = JCS_GRAYSCALE;
+    jpeg_start_decompress(&cinfo);
+    img_gray.set_size(cinfo.output_height, cinfo.output_width);
+
+    // three channel output is decoded into the color image, converted in place below
+    thread_local array2d<rgb_pixel> decoded;
+    array2d<rgb_pixel>& color = img ? *img : decoded;
+    if(cinfo.out_color_space != JCS_GRAYSCALE)
+        color.set_size(cinfo.output_height, cinfo.output_width);
+    while(cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row_pointer = cinfo.out_color_space == JCS_GRAYSCALE ? (JSAMPROW)&img_gray[cinfo.output_scanline][0] : (JSAMPROW)&color[cinfo.output_scanline][0];
+        jpeg_read_scanlines(&cinfo, &row_pointer, 1);
+    }
+    const J_COLOR_SPACE decodedSpace = cinfo.out_color_space;
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+
+    if(decodedSpace == JCS_GRAYSCALE) {
+        if(img) {
+            img->set_size(img_gray.nr(), img_gray.nc());
+            cv::cvtColor(toMat(img_gray), toMat(*img), cv::COLOR_GRAY2RGB);
+        }
+    }
+    else if(decodedSpace == JCS_YCbCr) {
+        // the luminance is the first channel, opencv orders the chroma channels Cr, Cb
+        cv::Mat ycc = toMat(color);
+        cv::extractChannel(ycc, toMat(img_gray), 0);
+        thread_local std::vector<cv::Mat> planes;
+        cv::split(ycc, planes);
+        std::swap(planes[1], planes[2]);
+        cv::merge(planes, ycc);
+        cv::cvtColor(ycc, ycc, cv::COLOR_YCrCb2RGB);
+    }
+    else
+        cv::cvtColor(toMat(color), toMat(img_gray), cv::COLOR_RGB2GRAY);
+    return scale;
 }
 
 Blob MNISTLeNet::to_jpeg(array2d<rgb_pixel>& img, size_t quality, const std::string& comment) {
@@ -224,36 +1200,26 @@ cv::Mat MNISTLeNet::translateImg(cv::Mat &img, int offsetx, int offsety){
     return img;
 }
 
-json::JSON MNISTLeNet::predict(const Blob& b){
-    // load image as rgb from blob
-    array2d<rgb_pixel> img;
-    load_jpeg(img, (unsigned char*)b.data(), b.size());
-
-    // load image as greyscale from blob
-    array2d<unsigned char> img_gray;
-    load_jpeg(img_gray, (unsigned char*)b.data(), b.size());
+json::JSON MNISTLeNet::predict(const Blob& b, bool vote, bool annotate){
+    // decode the picture once, in color only if it is returned annotated,
+    // the buffers of every request thread are reused for the next request
+    thread_local array2d<rgb_pixel> img;
+    thread_local array2d<unsigned char> img_gray;
+    unsigned int scale = from_jpeg(b, annotate ? &img : nullptr, img_gray);
 
     // ----------------------------------
     // ------ opencv manipulations ------
     cv::Mat ocv_bin;
-    cv::Mat ocv_auto;
-    std::vector<std::vector<cv::Point>> cnt;
-    std::vector<cv::Vec4i> hier;
-    BrightnessAndContrastAuto(toMat(img_gray), ocv_auto, 1); // better contrast
-    cv::threshold(ocv_auto, ocv_bin, 150, 255, cv::THRESH_BINARY_INV); // convert to inverted binary
-    cv::findContours(ocv_bin, cnt, hier, cv::RETR_TREE, cv::CHAIN_APPROX_NONE); // find contours
+    binarizeAuto(toMat(img_gray), ocv_bin, 1, 150); // better contrast, converted to inverted binary
 
-
-    // create bounding rectangles around contours
+    // create bounding rectangles around the outer blobs, blobs within holes of others
+    // are skipped, for instance two zeros within 8
     std::vector<cv::Rect> rcts;
-    for( size_t i = 0; i < cnt.size(); i++ )
+    for(auto const& blob : components::outerComponents(ocv_bin.data, ocv_bin.rows, ocv_bin.cols, ocv_bin.step))
     {
-        // skip if cnt is no parent (->3), 
-        // only use uppermost hierachy, skips for instance two zeros within 8
-        if(hier[i][3] != -1) continue;
-        cv::Rect rct = cv::boundingRect(cnt[i]);
-        // only use rectangles with at least 250 pixels and also filter way too big ones (caused by shadows etc.)
-        if(rct.area() > 250 && rct.width < ocv_bin.cols * 0.80 && rct.height < ocv_bin.rows * 0.80)
+        cv::Rect rct(blob.x, blob.y, blob.width, blob.height);
+        // only use rectangles with at least 250 pixels of the uploaded picture and also filter way too big ones (caused by shadows etc.)
+        if(rct.area() * scale * scale > 250 && rct.width < ocv_bin.cols * 0.80 && rct.height < ocv_bin.rows * 0.80)
             rcts.push_back(rct);
     }
 
@@ -263,9 +1229,11 @@ json::JSON MNISTLeNet::predict(const Blob& b){
         if(l.y == r.y) return l.x > r.x; return (l.y < r.y);
     });
 
-    // create subimages that match the mnist examples
-    std::vector<matrix<unsigned char>> digits;
-    for(auto const& curRct : rcts) {
+    // create subimages that match the mnist examples, the digits are independent of each other
+    // and normalized in parallel, digits[i] belongs to rcts[i]
+    std::vector<matrix<unsigned char>> digits(rcts.size());
+    auto normalize = [&](size_t i) {
+        auto const& curRct = rcts[i];
         // create cropped squared subimage
         size_t n = std::max(curRct.width, curRct.height);
         cv::Mat cro = ocv_bin(curRct);
@@ -286,33 +1254,111 @@ json::JSON MNISTLeNet::predict(const Blob& b){
         cv::Mat fin = translateImg(squ_border, m_ImgSize / 2 - com.x, m_ImgSize / 2 - com.y);
 
         // store resulting image as dlib matrix
-        matrix<unsigned char> dlibmtrx;
-        assign_image(dlibmtrx, cv_image<unsigned char>(cvIplImage(fin)));
-        digits.push_back(dlibmtrx);
-    }
+        assign_image(digits[i], cv_image<unsigned char>(cvIplImage(fin)));
+    };
+    if(m_Pool && rcts.size() > 1)
+        m_Pool->parallelFor(rcts.size(), normalize);
+    else
+        for(size_t i = 0; i < rcts.size(); i++)
+            normalize(i);
     // ------ end opencv manipulations ------
     // --------------------------------------
 
-    // do prediction
+    // do prediction, results are in the same order as rcts
+    // all passes of this request use the same network, even if it is reloaded meanwhile
+    auto backend = std::atomic_load(&m_Backend);
+    std::vector<matrix<float, 1, 10>> probs(digits.size());
+    std::vector<std::string> stages(digits.size(), "lenet");
+    std::vector<size_t> hard; // digits classified by the selected engine
+
+    // copies of the digits sampled for the candidate network, sampled from all digits of the request
+    // before the cascade, the originals may be moved to the scheduler
+    std::vector<size_t> shadowed;
+    ShadowEvaluator::Digits shadowDigits;
+    if(m_Shadow) {
+        shadowed = m_Shadow->sample(digits.size());
+        for(size_t i : shadowed)
+            shadowDigits.push_back(digits[i]);
+    }
+
+    if(m_CascadeThreshold > 0) {
+        // first stage of the cascade, only digits the tiny network is unsure about are passed on
+        probs = m_Tiny->classify(digits);
+        std::vector<matrix<unsigned char>> hardDigits;
+        for(size_t i = 0; i < digits.size(); i++) {
+            if(dlib::max(probs[i]) < m_CascadeThreshold) {
+                hard.push_back(i);
+                hardDigits.push_back(std::move(digits[i]));
+            }
+            else
+                stages[i] = "tiny";
+        }
+        digits = std::move(hardDigits);
+        m_TinyAnswers += probs.size() - hard.size();
+    }
+    else {
+        for(size_t i = 0; i < digits.size(); i++)
+            hard.push_back(i);
+    }
+
+    // variants of the voting mode are classified in parallel to the regular pass
+    auto deadline = std::chrono::steady_clock::now() + m_VoteBudget;
+    std::future<InferenceBackend::Probabilities> variants;
+    if(vote && m_Pool && !digits.empty())
+        variants = classifyVariants(digits, backend, deadline);
+
+    auto full = m_Scheduler && !digits.empty() ? m_Scheduler->submit(backend, std::move(digits)).get() : backend->classify(digits);
+    m_FullAnswers += hard.size();
+
+    // average the probabilities of the regular pass and the variants if they finished in time,
+    // variants are stored one after another, every one holding all digits
+    size_t votes = 1;
+    if(variants.valid() && variants.wait_until(deadline) == std::future_status::ready) {
+        try
+        {
+            auto p = variants.get();
+            if(!full.empty() && p.size() % full.size() == 0) {
+                for(size_t i = 0; i < p.size(); i++)
+                    full[i % full.size()] += p[i];
+                votes += p.size() / full.size();
+            }
+        }
+        catch(std::exception&)
+        {
+            // failed variants just do not vote
+        }
+    }
+    for(size_t i = 0; i < hard.size(); i++)
+        probs[hard[i]] = full[i] / static_cast<float>(votes);
+
+    // the candidate is compared with the served answers, whichever stage gave them, does not wait for it
+    if(!shadowed.empty()) {
+        ShadowEvaluator::Probabilities served;
+        for(size_t i : shadowed)
+            served.push_back(probs[i]);
+        m_Shadow->offer(std::move(shadowDigits), std::move(served));
+    }
+
     json::JSON retVal;
     retVal["predictions"] = json::Array();
-
-    // use softmax layer to access label probability
-    softmax<LeNet::subnet_type> sNet;
-    sNet.subnet() = m_Net.subnet();
-    for(auto const & curDigit : digits) {
-        matrix<float, 1, 10> p = mat(sNet(curDigit));
+    for(size_t i = 0; i < probs.size(); i++) {
+        auto const& p = probs[i];
         unsigned long highest = index_of_max(p);
         json::JSON pred;
         pred["label"] = highest;
         pred["probability"] = p(highest);
+        pred["stage"] = stages[i];
         retVal["predictions"].append(pred);
     }
+    if(vote)
+        retVal["votes"] = votes;
 
-    // draw green rectangles into original picture
-    for(auto const& curRct : rcts)
-        cv::rectangle(toMat(img), curRct, cv::Scalar(0, 255, 0), 2);
-    retVal["result_picture"] = to_jpeg(img).toBase64();
+    // draw green rectangles into the picture, decoded at the same scale as the image the rectangles were found on
+    if(annotate) {
+        for(auto const& curRct : rcts)
+            cv::rectangle(toMat(img), curRct, cv::Scalar(0, 255, 0), 2);
+        retVal["result_picture"] = to_jpeg(img).toBase64();
+    }
     return retVal;
 }
 
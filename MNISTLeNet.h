@@ -12,12 +12,21 @@
 
 #include <Object.h>
 #include <filesystem>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 #include <Blob.h>
 #include <JSON.h>
 #include <Exception.h>
 #include <dlib/dnn.h>
 #include <dlib/image_transforms.h>
 #include <opencv2/imgproc/imgproc.hpp>
+#include "InferenceBackend.h"
+#include "LeNetWeightFile.h"
+#include "BatchScheduler.h"
+#include "ShadowEvaluator.h"
+#include "WorkerPool.h"
+#include "DistillLoss.h"
 
 /**
  * @brief Exception to be thrown on errors within MNISTLeNet.
@@ -42,10 +51,16 @@ public:
      * @brief Will load a existing network if existent in path, will train a new newtork 
      * if no network exists. Network will be stored to path.
      * @param path Folder containing the mnist dataset and trained network if existent. (defaults to ./mnist)
+     * An empty path uses the network compiled into the executable (see make embed), which only supports the static and int8 engines.
+     * @param replicas Number of network replicas used for concurrent predictions, should match the number of worker threads. (defaults to 2)
+     * @param engine Inference engine used for predictions, dlib, static (compile time specialized LeNet), 
+     * int8 (quantized static engine, calibrated once per network using the mnist test set), pruned (LeNet with the 
+     * weakest filters and neurons removed, created and fine tuned on first use) or student (StudentNet
+     * distilled from LeNet on first use). (defaults to dlib)
      * @note The mnist dataset can be downloaded from: http://yann.lecun.com/exdb/mnist/
      */
-    MNISTLeNet(const std::filesystem::path& path = "mnist");
-    ~MNISTLeNet() = default;
+    MNISTLeNet(const std::filesystem::path& path = "mnist", size_t replicas = 2, const std::string& engine = "dlib");
+    ~MNISTLeNet();
 
     /**
      * @brief Will train a new newtork, result will be stored to the path set by the CTor.
@@ -55,14 +70,146 @@ public:
     /**
      * @brief Find digits on jpeg and does prediction using the trained network.
      * @param b Blob containing jpeg with handwritten digits.
+     * @param vote Classify shifted and scaled variants of every digit as well, in parallel (see setVoting()),
+     * and average the probabilities of all passes finished within the time budget.
+     * @param annotate Return the picture with the digits marked, the picture is decoded in color only then.
      * @returns JSON containing result with following structure:
      * {
-     * "predictions" : [{ "label" : 0, "probability" : 0.9 }],
+     * "predictions" : [{ "label" : 0, "probability" : 0.9, "stage" : "lenet" }],
+     * "votes" : 7,
      * "result_picture" : "base-64-encoded-jpeg"
      * }
+     * stage is tiny if the digit was answered by the first stage of the cascade, lenet otherwise.
+     * votes is the number of passes combined for the digits of the lenet stage, only present if vote is set.
+     * result_picture is only present if annotate is set, it has the size of the uploaded picture.
      */
-    giri::json::JSON predict(const giri::Blob& b);
+    giri::json::JSON predict(const giri::Blob& b, bool vote = false, bool annotate = true);
 
+    /**
+     * @brief Loads the network file again and swaps it in for new predictions, predictions in progress
+     * finish on the previous network. Pruned and student networks older than the network file are removed
+     * and recreated on next use. The pruned and student engines derive their network again in the background
+     * if it is older than the network file, the previous network serves until it is ready (failures are printed
+     * to stdout); a reload while deriving derives once more from the newest network file afterwards.
+     * The previous network keeps serving if loading fails.
+     * @throws MNISTLeNetException if the network could not be loaded or the embedded network is used.
+     */
+    void reload();
+
+    /**
+     * @brief Watches the network file in a background thread and reloads it (see reload()) when it changes.
+     * A changed file is only loaded once it stayed unchanged for one interval, so it is not read while being written.
+     * @param interval Time between two checks of the network file, 0 stops watching.
+     */
+    void watch(std::chrono::seconds interval);
+
+    /**
+     * @brief Usage statistics of the network replica pool.
+     * @returns JSON containing the statistics with following structure:
+     * {
+     * "engine" : "dlib",
+     * "replicas" : 2,
+     * "checkouts" : 100,
+     * "waits" : 3,
+     * "batches" : 40,
+     * "batched_requests" : 90,
+     * "tiny_answers" : 250,
+     * "lenet_answers" : 12,
+     * "reloads" : 1,
+     * "shadow_digits" : 80,
+     * "shadow_dropped" : 0,
+     * "shadow_agreement" : 98.75,
+     * "shadow_confidence_shift" : 0.01,
+     * "shadow_latency_us" : 210.0
+     * }
+     * replicas, checkouts and waits are only present for engines running dlib replicas (dlib, student),
+     * batches and batched_requests only if batching is enabled, 
+     * tiny_answers and lenet_answers only if the cascade is enabled,
+     * the shadow values only if shadow evaluation is enabled (agreement in percent).
+     */
+    giri::json::JSON statistics() const;
+
+    /**
+     * @brief Enables batching of the digits of concurrent predictions. Digits are collected until
+     * maxBatch digits are pending or the oldest prediction waited for maxWait, then all of them are
+     * classified at once. Trades a small bounded latency for throughput under load.
+     * One batch per network replica is classified at the same time.
+     * @param maxBatch Maximum number of digits per batch, 0 disables batching.
+     * @param maxWait Maximum time a prediction waits for others to join its batch.
+     */
+    void setBatching(size_t maxBatch, std::chrono::microseconds maxWait);
+
+    /**
+     * @brief Enables the two stage confidence cascade. Every digit is classified by TinyNet first,
+     * only digits it classifies with a probability below threshold are passed to the selected engine.
+     * TinyNet is loaded from the path set by the CTor, a new one is trained if none exists or it cannot be loaded.
+     * It is trained from the mnist labels, independent of LeNet, so reloading LeNet keeps it.
+     * train() removes TinyNet, and retrains it right away once the cascade is enabled.
+     * @param threshold Minimum probability of an answer of TinyNet, 0 disables the cascade.
+     */
+    void setCascade(float threshold);
+
+    /**
+     * @brief Sets the resolution digits are searched at. Larger pictures are scaled down by the largest of the factors
+     * 2, 4 and 8 keeping their longer side at least workingSize pixels, libjpeg then skips the discarded detail while decoding
+     * unless the annotated picture is requested. The annotated picture keeps the size of the uploaded one.
+     * @param workingSize Minimum length of the longer side in pixels, 0 decodes at full resolution.
+     */
+    void setWorkingSize(size_t workingSize);
+
+    /**
+     * @brief Sets up the worker pool shared by all requests. predict() normalizes the digits of a picture
+     * on it in parallel, and classifies the variants of the voting mode on it.
+     * @param threads Number of threads of the worker pool, 0 normalizes the digits on the thread
+     * of the request and disables voting.
+     */
+    void setWorkers(size_t threads);
+
+    /**
+     * @brief Configures the voting mode of predict(). The variants of the digits are classified by the worker pool
+     * (see setWorkers()), the regular pass runs on the thread of the request at the same time.
+     * @param budget Time the passes of a request may take, passes not finished by then are ignored.
+     */
+    void setVoting(std::chrono::milliseconds budget);
+
+    /**
+     * @brief Enables shadow evaluation of a candidate network. A fraction of all digits (including those answered
+     * by the first stage of the cascade) is classified by the candidate as well, on a low priority background thread,
+     * and compared with the answers served for them.
+     * Agreement, confidence shift and latency of the candidate are reported by statistics().
+     * Predictions never wait for the candidate, sampled digits are dropped if it cannot keep up.
+     * @param candidate Network file of the candidate (a trained LeNet), empty disables shadow evaluation.
+     * @param fraction Fraction of the digits classified by the candidate (0..1).
+     */
+    void setShadow(const std::filesystem::path& candidate, double fraction);
+
+    /**
+     * @brief Runs every available inference engine on the mnist test set. Engines whose network
+     * needs a training run first (pruned, student) are skipped if their network does not exist.
+     * Results are printed to stdout.
+     * @returns JSON containing the results with following structure:
+     * [{ "engine" : "dlib", "accuracy" : 99.1, "latency_us" : 250.0, "throughput" : 12000.0 }]
+     * latency_us is the average time of classifying a single digit, throughput is measured in digits 
+     * per second classifying the test set in batches.
+     */
+    giri::json::JSON benchmark();
+
+    /**
+     * @brief Writes the weight files of the static and int8 engines (mnist_network.weights, mnist_network.int8)
+     * next to the network file, unless they were already exported from it. Used by make embed.
+     * @throws MNISTLeNetException if the embedded network is used.
+     */
+    void exportWeights();
+
+    /**
+     * @brief Returns the backend of an inference engine (see CTor), the serving backend for the selected engine.
+     * Used to compare the engines with each other.
+     * @param engine Name of the engine.
+     * @returns The backend.
+     * @throws MNISTLeNetException if the engine is unknown or its network cannot be loaded. The networks of
+     * the pruned and student engines are derived first if they do not exist.
+     */
+    InferenceBackend::SPtr backend(const std::string& engine);
 
     // LeNet definition
     using LeNet = dlib::loss_multiclass_log<
@@ -74,16 +221,71 @@ public:
                                 dlib::input<dlib::matrix<unsigned char>> 
                                 >>>>>>>>>>>>;
 
+    // LeNet used for predictions, softmax layer gives access to the label probabilities
+    using InferenceNet = dlib::softmax<LeNet::subnet_type>;
+
+    // first stage of the cascade, about 1/18 of the multiply-adds of LeNet
+    // (1x28x28 -> con 8x12x12 -> relu, max_pool 8x6x6 -> fc 32 -> relu -> fc 10)
+    using TinyNet = dlib::loss_multiclass_log<
+                                dlib::fc<10,
+                                dlib::relu<dlib::fc<32,
+                                dlib::max_pool<2,2,2,2,dlib::relu<dlib::con<8,5,5,2,2,
+                                dlib::input<dlib::matrix<unsigned char>>
+                                >>>>>>>;
+    using TinyInferenceNet = dlib::softmax<TinyNet::subnet_type>;
+
+    // narrower network distilled from LeNet, about 2.6x less multiply-adds
+    // (1x28x28 -> con 4x28x28 -> relu, max_pool 4x14x14 -> con 8x14x14 -> relu, max_pool 8x7x7 -> fc 64 -> relu -> fc 10)
+    using StudentNet = dlib::loss_multiclass_log<
+                                dlib::fc<10,
+                                dlib::relu<dlib::fc<64,
+                                dlib::max_pool<2,2,2,2,dlib::relu<dlib::con<8,5,5,1,1,
+                                dlib::max_pool<2,2,2,2,dlib::relu<dlib::con<4,5,5,1,1,
+                                dlib::input<dlib::matrix<unsigned char>>
+                                >>>>>>>>>>;
+    using StudentInferenceNet = dlib::softmax<StudentNet::subnet_type>;
+
+    // StudentNet trained on the soft targets of LeNet
+    using DistillNet = loss_distill<StudentNet::subnet_type>;
+
+    /**
+     * @brief Distills a new StudentNet from the trained network (teacher) using the mnist dataset
+     * and stores it within the path set by the CTor. The teacher outputs on the training set, softened 
+     * by a temperature and blended with the true labels, are used as training targets.
+     * @throws MNISTLeNetException if the student accuracy on the test set is more than 
+     * m_StudentMaxAccuracyLoss percentage points below the teacher, the student is not stored then.
+     * The trainer state is removed on failure, so the next attempt starts over.
+     */
+    void distill();
+
+    /**
+     * @brief Removes the trainer synchronization files of distill().
+     */
+    void removeStudentSyncFiles();
+
 private:
 
     /**
-     *  @brief Automatic brightness and contrast optimization with optional histogram clipping.
-     *  @param src [out] Input image GRAY or BGR or BGRA
-     *  @param dst [in] Destination image 
+     *  @brief Automatic brightness and contrast optimization with optional histogram clipping,
+     *  followed by an inverted binary threshold, computed in a single pass over the image.
+     *  @param gray [in] Grayscale input image
+     *  @param bin [out] Inverted binary image, 255 where the normalized image is at most threshold
      *  @param clipHistPercent cut wings of histogram at given percent tipical=>1, 0=>Disabled
-     *  @note In case of BGRA image, we won't touch the transparency
+     *  @param threshold Threshold applied to the normalized image
+     *  @note The histogram is computed on a subsample of about m_HistogramSamples pixels.
      */
-    void BrightnessAndContrastAuto(const cv::Mat &src, cv::Mat &dst, float clipHistPercent=0);
+    void binarizeAuto(const cv::Mat &gray, cv::Mat &bin, float clipHistPercent, int threshold);
+
+    /**
+     * @brief Decodes a jpeg once, into the given images. Their memory is reused if the picture has the same size as before.
+     * Large pictures are scaled down (1/2, 1/4 or 1/8, see setWorkingSize()) by libjpeg while decoding, both images
+     * have the same size. The grayscale image is the same whether a color image is requested or not.
+     * @param b Blob containing the jpeg.
+     * @param img [out] Color image, nullptr decodes straight to grayscale.
+     * @param img_gray [out] Grayscale image.
+     * @returns Factor both images were scaled down by.
+     */
+    unsigned int from_jpeg(const giri::Blob& b, dlib::array2d<dlib::rgb_pixel>* img, dlib::array2d<unsigned char>& img_gray);
 
     /**
      * @brief Converts an dlib RGB image to jpeg
@@ -104,6 +306,112 @@ private:
                         const std::string& comment = "Pic from giri's MNIST LeNet example."
                       );
 
+    /**
+     * @brief Loads the weights of the static engine and creates the selected backend, 
+     * needs to be called whenever the network file changes.
+     */
+    void updateInferenceNet();
+
+    /**
+     * @brief Removes the pruned and student networks (and their sync files) if they are
+     * older than the network file, they are recreated on next use.
+     */
+    void removeStaleNetworks();
+
+    /**
+     * @brief Derives the network of the pruned or student engine from the reloaded network file on m_Deriver
+     * and swaps it in once ready. Called by reload() while no derivation is running.
+     */
+    void deriveInBackground();
+
+    /**
+     * @brief Returns the reference backend, the trained network (without loss layer) is loaded on first use.
+     * @returns The reference backend (m_Reference).
+     */
+    std::shared_ptr<DlibBackend<MNISTLeNet::InferenceNet>> reference();
+
+    /**
+     * @brief Returns the weights of the static engine, they are loaded by loadWeights() on first use.
+     * @returns The weights of the static engine (m_Weights).
+     */
+    std::shared_ptr<const lenet::Weights> weights();
+
+    /**
+     * @brief Maps the flat weight file of the static engine (see LeNetWeightFile.h). The file is 
+     * exported from the trained network first if it does not exist or was exported from another network file.
+     * @returns Weights of the static engine.
+     */
+    std::shared_ptr<const lenet::Weights> loadWeights();
+
+    /**
+     * @brief Creates the backend of an inference engine (see CTor) based on the trained network.
+     * @param engine Name of the engine.
+     * @returns The backend, the reference backend (m_Reference) for dlib.
+     */
+    InferenceBackend::SPtr createBackend(const std::string& engine);
+
+    /**
+     * @brief Loads the pruned network stored next to the trained network,
+     * the pruned network is created by prune() if it does not exist yet.
+     * @returns Weights of the pruned engine.
+     */
+    std::shared_ptr<const lenet::pruned::Weights> loadPrunedNet();
+
+    /**
+     * @brief Removes the filters and neurons with the smallest L1 norms (m_PruneFraction of every
+     * hidden layer) from the trained network, fine tunes the compacted network using the mnist 
+     * dataset and stores it next to the trained network. Accuracy is printed to stdout.
+     */
+    void prune();
+
+    /**
+     * @brief Loads the student network, a new student is distilled if none exists.
+     * @returns Backend running the student network.
+     */
+    InferenceBackend::SPtr loadStudentNet();
+
+    /**
+     * @brief Trains a new TinyNet and stores it within the path set by the CTor.
+     */
+    void trainTiny();
+
+    /**
+     * @brief Copies TinyNet into the backend of the first cascade stage.
+     */
+    void updateTinyNet();
+
+    /**
+     * @brief Throws if the mnist dataset is not found within the path set by the CTor.
+     */
+    void checkDataSet() const;
+
+    /**
+     * @brief Maps the quantized weight file of the int8 engine (see LeNetWeightFile.h). The weights are 
+     * quantized and stored first if the file does not exist or was quantized from another network file.
+     * @returns Weights of the int8 engine.
+     */
+    std::shared_ptr<const lenet::int8::Weights> loadQuantizedWeights();
+
+    /**
+     * @brief Quantizes the weights of the static engine to INT8. Activations are calibrated using the
+     * first CalibrationDigits of the mnist test set, accuracy on these digits compared to the float network
+     * is printed to stdout.
+     * @returns Weights of the int8 engine.
+     */
+    std::shared_ptr<const lenet::int8::Weights> quantize();
+
+    /**
+     * @brief Classifies variants of the digits for the voting mode (see predict()) in one batch, by one task
+     * of the worker pool using InferenceBackend::classifyBackground().
+     * @param digits 28x28 images of the digits.
+     * @param backend Backend classifying the variants.
+     * @returns Future receiving the probabilities of all variants (one pixel shifts in every direction, scaled
+     * by 0.9 and 1.1) one after another, each covering all digits. No probabilities if not started by deadline.
+     */
+    std::future<InferenceBackend::Probabilities> classifyVariants(const InferenceBackend::Digits& digits,
+                                                                  InferenceBackend::SPtr backend,
+                                                                  std::chrono::steady_clock::time_point deadline);
+
     /**
      * @brief Allows moving/recentering image
      * @param img Image to use
@@ -113,6 +421,8 @@ private:
      */
     cv::Mat translateImg(cv::Mat &img, int offsetx, int offsety);
 
+    size_t m_Replicas;
+    std::string m_Engine;
     std::filesystem::path m_DataSetPath;
     std::filesystem::path m_Images;
     std::filesystem::path m_Labels;
@@ -120,10 +430,72 @@ private:
     std::filesystem::path m_TestLabels;
     std::filesystem::path m_NetworkFile;
     std::filesystem::path m_SyncFile;
-    MNISTLeNet::LeNet m_Net;
+    std::filesystem::path m_WeightFile;
+    std::filesystem::path m_QuantizedWeightFile;
+    std::filesystem::path m_TinyNetworkFile;
+    std::filesystem::path m_TinySyncFile;
+    std::filesystem::path m_PrunedNetworkFile;
+    std::filesystem::path m_PrunedSyncFile;
+    std::filesystem::path m_StudentNetworkFile;
+    std::filesystem::path m_StudentSyncFile;
+    std::shared_ptr<DlibBackend<MNISTLeNet::InferenceNet>> m_Reference; // dlib backend, also used for calibration and distillation
+    mutable std::mutex m_ReferenceMutex; // guards m_Reference, which is loaded on first use
+    std::shared_ptr<const lenet::Weights> m_Weights; // weights of the static and int8 engines
+    std::mutex m_WeightsMutex; // guards m_Weights, which are loaded on first use
+    InferenceBackend::SPtr m_Backend; // backend of the selected engine, replaced atomically by reload()
+
+    // hot reload of the network file
+    std::mutex m_ReloadMutex; // serializes reloads
+    std::atomic<unsigned long long> m_Reloads{0};
+    std::thread m_Watcher;
+    std::mutex m_WatchMutex;
+    std::condition_variable m_WatchCv;
+    bool m_WatchStop = false;
+
+    // pruned and student networks derived again after a reload
+    std::thread m_Deriver;
+    std::mutex m_DeriveMutex;
+    bool m_Deriving = false;    // m_Deriver is running
+    bool m_DeriveAgain = false; // the network file was reloaded while deriving
+
+    // fraction of the filters and neurons of every hidden layer removed by prune()
+    float m_PruneFraction = 0.5;
+
+    // weight of the teacher outputs within the distillation targets
+    // and maximum accuracy loss (percentage points) accepted by distill()
+    float m_SoftTargetWeight = 0.9;
+    double m_StudentMaxAccuracyLoss = 1.0;
+
+    // confidence cascade
+    float m_CascadeThreshold = 0;
+    std::shared_ptr<DlibBackend<MNISTLeNet::TinyInferenceNet>> m_Tiny;
+    std::atomic<unsigned long long> m_TinyAnswers{0};
+    std::atomic<unsigned long long> m_FullAnswers{0};
+
+    // number of pixels sampled for the histogram of binarizeAuto
+    size_t m_HistogramSamples = 1 << 16;
+
+    // minimum length of the longer side of decoded pictures, 0 decodes at full resolution
+    size_t m_WorkingSize = 1024;
 
     // MNIST image size
     size_t m_ImgSize = 28;
     size_t m_DigitSize = 20;
+
+    // maximum number of digits pushed through the network at once
+    size_t m_BatchSize = 128;
+
+    // voting mode, the passes on the variants of the digits run on the worker pool
+    std::chrono::milliseconds m_VoteBudget{0};
+
+    // threads shared by all requests, normalize the digits and run the voting passes
+    WorkerPool::UPtr m_Pool;
+
+    // shadow evaluation of a candidate network
+    size_t m_ShadowMaxQueued = 1024;
+    ShadowEvaluator::UPtr m_Shadow;
+
+    // batches digits of concurrent predictions, declared last so it stops before the networks are destroyed
+    BatchScheduler::UPtr m_Scheduler;
 };
 #endif // MNISTLENET_H
\ No newline at end of file
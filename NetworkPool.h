@@ -0,0 +1,126 @@
+/**
+ * @file NetworkPool.h
+ * @brief Thread safe pool of network replicas used for concurrent predictions.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#ifndef NETWORKPOOL_H
+#define NETWORKPOOL_H
+
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+/**
+ * @brief Thread safe pool of network replicas.
+ *
+ * dlib networks store their layer outputs within the network object, so a
+ * network must not be used by more than one thread at once. The pool holds
+ * one replica per worker thread, a thread checks out a replica for the
+ * duration of a forward pass and returns it afterwards.
+ *
+ * @tparam Net dlib network type (needs to be copy constructible)
+ */
+template<typename Net>
+class NetworkPool
+{
+public:
+    /**
+     * @brief Grants exclusive access to one replica, returns the replica to the pool on destruction.
+     */
+    class Lease
+    {
+    public:
+        Lease(NetworkPool* pool, Net* net) : m_Pool(pool), m_Net(net) {}
+        Lease(Lease&& other) : m_Pool(other.m_Pool), m_Net(other.m_Net) { other.m_Net = nullptr; }
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+        Lease& operator=(Lease&&) = delete;
+        ~Lease() { if(m_Net) m_Pool->checkin(m_Net); }
+
+        Net& operator*() const { return *m_Net; }
+        Net* operator->() const { return m_Net; }
+
+    private:
+        NetworkPool* m_Pool;
+        Net* m_Net;
+    };
+
+    NetworkPool() = default;
+    NetworkPool(const NetworkPool&) = delete;
+    NetworkPool& operator=(const NetworkPool&) = delete;
+
+    /**
+     * @brief Replaces all replicas by copies of the given network.
+     * Blocks until all currently checked out replicas have been returned.
+     * @param prototype Network to copy.
+     * @param replicas Number of replicas to create (at least one will be created).
+     */
+    void reset(const Net& prototype, size_t replicas) {
+        std::unique_lock<std::mutex> lck(m_Mutex);
+        m_Returned.wait(lck, [this]{ return m_Free.size() == m_Replicas.size(); });
+        m_Free.clear();
+        m_Replicas.clear();
+        for(size_t i = 0; i < std::max<size_t>(replicas, 1); i++){
+            m_Replicas.push_back(std::make_unique<Net>(prototype));
+            m_Free.push_back(m_Replicas.back().get());
+        }
+    }
+
+    /**
+     * @brief Checks out a replica, waits if all replicas are in use.
+     * @returns Lease granting exclusive access to the replica.
+     */
+    Lease checkout() {
+        std::unique_lock<std::mutex> lck(m_Mutex);
+        m_Checkouts++;
+        if(m_Free.empty()){
+            m_Waits++;
+            m_Returned.wait(lck, [this]{ return !m_Free.empty(); });
+        }
+        Net* net = m_Free.back();
+        m_Free.pop_back();
+        return Lease(this, net);
+    }
+
+    /**
+     * @returns Number of replicas held by the pool.
+     */
+    size_t size() const {
+        std::lock_guard<std::mutex> lck(m_Mutex);
+        return m_Replicas.size();
+    }
+
+    /**
+     * @returns Number of checkouts since creation of the pool.
+     */
+    unsigned long long checkouts() const { return m_Checkouts; }
+
+    /**
+     * @returns Number of checkouts that had to wait for a free replica.
+     */
+    unsigned long long waits() const { return m_Waits; }
+
+private:
+    void checkin(Net* net) {
+        {
+            std::lock_guard<std::mutex> lck(m_Mutex);
+            m_Free.push_back(net);
+        }
+        m_Returned.notify_all();
+    }
+
+    mutable std::mutex m_Mutex;
+    std::condition_variable m_Returned;
+    std::vector<std::unique_ptr<Net>> m_Replicas;
+    std::vector<Net*> m_Free;
+    std::atomic<unsigned long long> m_Checkouts{0};
+    std::atomic<unsigned long long> m_Waits{0};
+};
+
+#endif // NETWORKPOOL_H
@@ -0,0 +1,138 @@
+/**
+ * @file ShadowEvaluator.cpp
+ * @brief Compares a candidate network with the serving network on a sample of live digits.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#include "ShadowEvaluator.h"
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+namespace
+{
+    /**
+     * @brief Lowers the scheduling priority of the calling thread, the candidate only gets cpu time left over by the requests.
+     */
+    void lowerThreadPriority() {
+#if defined(_WIN32)
+        SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+#elif defined(__linux__)
+        // on linux the nice value of a thread id only affects that thread
+        setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 19);
+#endif
+    }
+}
+
+ShadowEvaluator::ShadowEvaluator(const Classifier& candidate, double fraction, size_t maxQueued) :
+    m_Candidate(candidate), m_Fraction(std::min(std::max(fraction, 0.0), 1.0)), m_MaxQueued(std::max<size_t>(maxQueued, 1)) {
+    m_Worker = std::thread(&ShadowEvaluator::run, this);
+}
+
+ShadowEvaluator::~ShadowEvaluator() {
+    {
+        std::lock_guard<std::mutex> lck(m_Mutex);
+        m_Stop = true;
+    }
+    m_Pending.notify_all();
+    m_Worker.join();
+}
+
+std::vector<size_t> ShadowEvaluator::sample(size_t count) {
+    // digit n is sampled if the expected number of samples reaches the next integer at n
+    std::vector<size_t> picked;
+    unsigned long long first = m_Offered.fetch_add(count);
+    for(size_t i = 0; i < count; i++)
+        if(std::floor((first + i + 1) * m_Fraction) > std::floor((first + i) * m_Fraction))
+            picked.push_back(i);
+    return picked;
+}
+
+void ShadowEvaluator::offer(Digits digits, Probabilities served) {
+    if(digits.empty())
+        return;
+
+    // never wait for the worker, drop the digits instead
+    std::unique_lock<std::mutex> lck(m_Mutex, std::try_to_lock);
+    if(!lck.owns_lock() || m_QueuedDigits + digits.size() > m_MaxQueued) {
+        m_Dropped += digits.size();
+        return;
+    }
+    m_QueuedDigits += digits.size();
+    m_Queue.push_back({ std::move(digits), std::move(served) });
+    lck.unlock();
+    m_Pending.notify_one();
+}
+
+double ShadowEvaluator::agreement() const {
+    std::lock_guard<std::mutex> lck(m_StatsMutex);
+    return m_Compared ? 100.0 * m_Agreed / m_Compared : 0;
+}
+
+double ShadowEvaluator::confidenceShift() const {
+    std::lock_guard<std::mutex> lck(m_StatsMutex);
+    return m_Compared ? m_ConfidenceShift / m_Compared : 0;
+}
+
+double ShadowEvaluator::latency() const {
+    std::lock_guard<std::mutex> lck(m_StatsMutex);
+    return m_Compared ? m_Microseconds / m_Compared : 0;
+}
+
+void ShadowEvaluator::run() {
+    lowerThreadPriority();
+    std::unique_lock<std::mutex> lck(m_Mutex);
+    while(true) {
+        m_Pending.wait(lck, [this]{ return m_Stop || !m_Queue.empty(); });
+        if(m_Stop)
+            return; // pending digits are not needed anymore
+
+        // classify everything queued so far at once
+        Digits digits;
+        Probabilities served;
+        while(!m_Queue.empty()) {
+            auto& item = m_Queue.front();
+            digits.insert(digits.end(), item.digits.begin(), item.digits.end());
+            served.insert(served.end(), item.served.begin(), item.served.end());
+            m_Queue.pop_front();
+        }
+        m_QueuedDigits = 0;
+        lck.unlock();
+
+        Probabilities candidate;
+        auto start = std::chrono::steady_clock::now();
+        try {
+            candidate = m_Candidate(digits);
+        }
+        catch(...) {
+            // a failing candidate must not affect the service, its digits count as dropped
+            candidate.clear();
+        }
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+        if(candidate.size() != digits.size())
+            m_Dropped += digits.size();
+        else {
+            std::lock_guard<std::mutex> stats(m_StatsMutex);
+            for(size_t i = 0; i < digits.size(); i++) {
+                long servedLabel = dlib::index_of_max(served[i]);
+                long candidateLabel = dlib::index_of_max(candidate[i]);
+                m_Agreed += servedLabel == candidateLabel;
+                m_ConfidenceShift += candidate[i](candidateLabel) - served[i](servedLabel);
+            }
+            m_Microseconds += us;
+            m_Compared += digits.size();
+        }
+        lck.lock();
+    }
+}
@@ -0,0 +1,117 @@
+/**
+ * @file ShadowEvaluator.h
+ * @brief Compares a candidate network with the serving network on a sample of live digits.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#ifndef SHADOWEVALUATOR_H
+#define SHADOWEVALUATOR_H
+
+#include <Object.h>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include <dlib/matrix.h>
+
+/**
+ * @brief Compares a candidate network with the serving network on a sample of live digits.
+ *
+ * Requests pick a fraction of their digits using sample() and hand them over together with the
+ * answers of the serving network using offer(). A background thread running at low priority
+ * classifies them using the candidate and records agreement, confidence and latency.
+ * Requests never wait for the candidate: offered digits are dropped if the queue is full
+ * or currently locked by another thread.
+ */
+class ShadowEvaluator : public giri::Object<ShadowEvaluator>
+{
+public:
+    using Digits = std::vector<dlib::matrix<unsigned char>>;
+    using Probabilities = std::vector<dlib::matrix<float, 1, 10>>;
+    using Classifier = std::function<Probabilities(const Digits&)>;
+
+    /**
+     * @param candidate Function classifying digits using the candidate network, results need to be in the same order as the digits.
+     * @param fraction Fraction of the digits classified by the candidate (0..1).
+     * @param maxQueued Maximum number of digits waiting for the candidate, further digits are dropped.
+     */
+    ShadowEvaluator(const Classifier& candidate, double fraction, size_t maxQueued);
+    ~ShadowEvaluator();
+
+    /**
+     * @brief Picks the digits of a request to compare, evenly spaced over all requests.
+     * @param count Number of digits of the request.
+     * @returns Indices of the digits to pass to offer().
+     */
+    std::vector<size_t> sample(size_t count);
+
+    /**
+     * @brief Queues digits for the candidate, returns immediately.
+     * @param digits 28x28 images of the digits.
+     * @param served Label probabilities of the serving network, in the same order as digits.
+     */
+    void offer(Digits digits, Probabilities served);
+
+    /**
+     * @returns Number of digits classified by the candidate so far.
+     */
+    unsigned long long compared() const { return m_Compared; }
+
+    /**
+     * @returns Number of sampled digits dropped because the candidate could not keep up.
+     */
+    unsigned long long dropped() const { return m_Dropped; }
+
+    /**
+     * @returns Percentage of the compared digits the candidate labeled like the serving network.
+     */
+    double agreement() const;
+
+    /**
+     * @returns Average probability of the candidate's label minus the average probability of the serving
+     * network's label, positive if the candidate is more confident.
+     */
+    double confidenceShift() const;
+
+    /**
+     * @returns Average time in microseconds the candidate needed per digit.
+     */
+    double latency() const;
+
+private:
+    struct Item
+    {
+        Digits digits;
+        Probabilities served;
+    };
+
+    void run();
+
+    Classifier m_Candidate;
+    double m_Fraction;
+    size_t m_MaxQueued;
+    std::atomic<unsigned long long> m_Offered{0}; // digits seen by sample(), spaces the samples evenly
+
+    std::mutex m_Mutex;
+    std::condition_variable m_Pending;
+    std::deque<Item> m_Queue;
+    size_t m_QueuedDigits = 0;
+    bool m_Stop = false;
+
+    // results, sums are guarded by m_StatsMutex
+    mutable std::mutex m_StatsMutex;
+    std::atomic<unsigned long long> m_Compared{0};
+    std::atomic<unsigned long long> m_Dropped{0};
+    unsigned long long m_Agreed = 0;
+    double m_ConfidenceShift = 0;
+    double m_Microseconds = 0;
+
+    std::thread m_Worker;
+};
+
+#endif // SHADOWEVALUATOR_H
@@ -42,7 +42,9 @@ void WSSObserver::update(WebSocketSession::SPtr sess){
 
                 Blob pic;
                 pic.loadBase64(msg["picture"].ToString());
-                answ["result"] = m_Network->predict(pic);
+                bool vote = msg.hasKey("vote") && msg["vote"].ToBool(); // opt-in multi-pass voting
+                bool annotate = !msg.hasKey("annotate") || msg["annotate"].ToBool(); // result picture, on by default
+                answ["result"] = m_Network->predict(pic, vote, annotate);
                 answ["state"] = "ok";
                 sess->send(answ.ToString());
                 return;
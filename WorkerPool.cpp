@@ -0,0 +1,93 @@
+/**
+ * @file WorkerPool.cpp
+ * @brief Fixed set of threads running tasks shared by all requests.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#include "WorkerPool.h"
+
+namespace
+{
+    // pool and queue of the calling worker thread
+    thread_local const WorkerPool* t_Pool = nullptr;
+    thread_local size_t t_Worker = 0;
+}
+
+WorkerPool::WorkerPool(size_t threads) {
+    threads = std::max<size_t>(threads, 1);
+    for(size_t i = 0; i < threads; i++)
+        m_Queues.push_back(std::make_unique<Queue>());
+    for(size_t i = 0; i < threads; i++)
+        m_Workers.emplace_back(&WorkerPool::run, this, i);
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lck(m_Mutex);
+        m_Stop = true;
+    }
+    m_Pending.notify_all();
+    for(auto& worker : m_Workers)
+        worker.join();
+}
+
+void WorkerPool::push(std::function<void()> task) {
+    size_t worker = t_Pool == this ? t_Worker : m_Next++ % m_Queues.size();
+
+    // counted before it is queued, a worker seeing the count may spin until the task arrives but never misses it
+    m_Queued++;
+    {
+        std::lock_guard<std::mutex> lck(m_Queues[worker]->mutex);
+        m_Queues[worker]->tasks.push_back(std::move(task));
+    }
+    {
+        // taken so the notification cannot get lost between the check and the wait of a worker
+        std::lock_guard<std::mutex> lck(m_Mutex);
+    }
+    m_Pending.notify_one();
+}
+
+bool WorkerPool::pop(size_t worker, std::function<void()>& task) {
+    // newest task of the own queue first
+    {
+        Queue& own = *m_Queues[worker];
+        std::lock_guard<std::mutex> lck(own.mutex);
+        if(!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+
+    // steal the oldest task of another worker
+    for(size_t i = 1; i < m_Queues.size(); i++) {
+        Queue& other = *m_Queues[(worker + i) % m_Queues.size()];
+        std::lock_guard<std::mutex> lck(other.mutex);
+        if(!other.tasks.empty()) {
+            task = std::move(other.tasks.front());
+            other.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkerPool::run(size_t worker) {
+    t_Pool = this;
+    t_Worker = worker;
+    while(!m_Stop) {
+        std::function<void()> task;
+        if(pop(worker, task)) {
+            m_Queued--;
+            // exceptions are stored in the future of the task
+            task();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lck(m_Mutex);
+        m_Pending.wait(lck, [this]{ return m_Stop || m_Queued > 0; });
+    }
+}
@@ -0,0 +1,144 @@
+/**
+ * @file WorkerPool.h
+ * @brief Fixed set of threads running tasks shared by all requests.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <Object.h>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <future>
+#include <vector>
+#include <exception>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+#include <condition_variable>
+
+/**
+ * @brief Fixed set of threads running tasks shared by all requests.
+ *
+ * Requests split their work into tasks and submit them instead of starting threads of their own,
+ * so the number of threads does not grow with the number of concurrent requests.
+ * Every worker has a queue of its own, tasks are distributed round robin (tasks submitted by a worker
+ * stay in its queue). Workers run the newest task of their queue first, which is the one most likely
+ * still in its cache, and steal the oldest task of another worker once theirs is empty, so a request
+ * splitting its work unevenly does not leave workers idle.
+ */
+class WorkerPool : public giri::Object<WorkerPool>
+{
+public:
+    /**
+     * @param threads Number of worker threads, at least one thread is started.
+     */
+    explicit WorkerPool(size_t threads);
+
+    /**
+     * @brief Waits for the running tasks, tasks not started yet are discarded (their futures report broken_promise).
+     */
+    ~WorkerPool();
+
+    /**
+     * @brief Queues a task.
+     * @param task Function to run on one of the worker threads.
+     * @returns Future receiving the result of the task, or the exception thrown by it.
+     */
+    template<typename F>
+    std::future<std::invoke_result_t<F>> submit(F&& task) {
+        using Result = std::invoke_result_t<F>;
+        auto packaged = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(task));
+        std::future<Result> fut = packaged->get_future();
+        push([packaged]() { (*packaged)(); });
+        return fut;
+    }
+
+    /**
+     * @brief Calls f(i) for every i in [0, count) and waits for all calls to finish.
+     * The range is split into a few chunks per worker. The calling thread takes chunks as well
+     * until none are left, so it never waits for a chunk that did not start yet and calls from
+     * worker threads or concurrent calls cannot block each other.
+     * @param count Number of calls.
+     * @param f Function called with the index, calls for different indices run concurrently.
+     * @throws The first exception thrown by f, after all chunks finished.
+     */
+    template<typename F>
+    void parallelFor(size_t count, F&& f) {
+        const size_t chunks = std::min(count, (size() + 1) * 4);
+        if(chunks == 0)
+            return;
+
+        // helpers starting after the last chunk was taken return without touching f
+        struct State
+        {
+            std::atomic<size_t> next{0};
+            size_t done = 0;
+            std::exception_ptr error;
+            std::mutex mutex;
+            std::condition_variable finished;
+        };
+        auto state = std::make_shared<State>();
+        auto work = [state, &f, count, chunks]() {
+            for(size_t c = state->next++; c < chunks; c = state->next++) {
+                std::exception_ptr error;
+                try {
+                    for(size_t i = c * count / chunks; i < (c + 1) * count / chunks; i++)
+                        f(i);
+                }
+                catch(...) {
+                    error = std::current_exception();
+                }
+                std::lock_guard<std::mutex> lck(state->mutex);
+                if(error && !state->error)
+                    state->error = error;
+                if(++state->done == chunks)
+                    state->finished.notify_all();
+            }
+        };
+        for(size_t i = 0; i < std::min(size(), chunks - 1); i++)
+            push(work);
+        work();
+
+        // only chunks running on other threads are left
+        std::unique_lock<std::mutex> lck(state->mutex);
+        state->finished.wait(lck, [&]{ return state->done == chunks; });
+        if(state->error)
+            std::rethrow_exception(state->error);
+    }
+
+    /**
+     * @returns Number of worker threads.
+     */
+    size_t size() const { return m_Workers.size(); }
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    void push(std::function<void()> task);
+    bool pop(size_t worker, std::function<void()>& task);
+    void run(size_t worker);
+
+    std::vector<std::unique_ptr<Queue>> m_Queues;
+    std::atomic<size_t> m_Next{0};
+    std::atomic<size_t> m_Queued{0};
+    std::atomic<bool> m_Stop{false};
+
+    // idle workers sleep until a task is queued
+    std::mutex m_Mutex;
+    std::condition_variable m_Pending;
+    std::vector<std::thread> m_Workers;
+};
+
+#endif // WORKERPOOL_H
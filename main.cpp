@@ -28,7 +28,20 @@ int main(int argc, char** argv)
         ("key", po::value<std::string>(), "Private key for the certificate file, if provided this file is used for tls encryption of the websocket and http connections.")
         ("httpport", po::value<std::string>(), "Port to listen for HTTP connections. (defaults to 8808)")
         ("wssport", po::value<std::string>(), "Port to listen for WebSocket connections. (defaults to 8809)")
-        ("mnist", po::value<std::string>(), "Path to folder which contains the mnist dataset. (defaults to ./mnist)")
+        ("threads", po::value<size_t>(), "Number of threads handling WebSocket requests, one network replica is created per thread. (defaults to 2)")
+        ("engine", po::value<std::string>(), "Inference engine used for predictions: dlib, static (LeNet specialized at compile time), int8 (quantized static engine, calibrated once per network using the mnist test set), pruned (half of the filters and neurons removed and fine tuned, created on first use) or student (smaller network distilled from the LeNet on first use). (defaults to dlib)")
+        ("maxbatch", po::value<size_t>(), "Maximum number of digits of concurrent requests classified together, 0 disables batching. (defaults to 0)")
+        ("batchwait", po::value<size_t>(), "Maximum time in microseconds a request waits for other requests to join its batch. (defaults to 1000)")
+        ("cascade", po::value<float>(), "Confidence threshold of the two stage cascade (e.g. 0.99), digits are classified by a tiny network first and only passed to the selected engine if its probability is below the threshold. The tiny network is trained on first use, 0 disables the cascade. (defaults to 0)")
+        ("watch", po::value<size_t>(), "Interval in seconds to check the network file for changes, a changed network is loaded in the background and used for new requests. 0 disables watching, the network can still be reloaded by the reload command. (defaults to 0)")
+        ("workingsize", po::value<size_t>(), "Minimum length in pixels of the longer side of the image digits are searched on. Larger pictures are scaled down by 2, 4 or 8 while decoding, which speeds up decoding and segmentation. 0 searches at full resolution. (defaults to 1024)")
+        ("workers", po::value<size_t>(), "Number of threads shared by all requests, normalizing the digits of a picture in parallel and classifying the variants of voting requests. 0 normalizes on the thread of the request and disables voting. (defaults to the number of cpu cores)")
+        ("votebudget", po::value<size_t>(), "Time budget in milliseconds of requests setting the vote flag, passes on shifted and scaled variants of the digits not finished by then are ignored. (defaults to 50)")
+        ("shadow", po::value<std::string>(), "Network file of a candidate network (e.g. a retrained mnist_network.dat) evaluated in shadow mode: a fraction of the digits is classified by the candidate as well, in the background, and compared with the served answers. Results are printed by the stats command.")
+        ("shadowfraction", po::value<double>(), "Fraction of the digits classified by the shadow candidate. (defaults to 0.1)")
+        ("benchmark", "Runs every available inference engine on the mnist test set, prints accuracy, latency and throughput and exits.")
+        ("export", "Writes the weight files of the static and int8 engines next to the trained network and exits, used by make embed.")
+        ("mnist", po::value<std::string>(), "Path to folder which contains the mnist dataset. (defaults to ./mnist, or to the network compiled into the executable with the static engine if built after make embed)")
         ("client", po::value<std::string>(), "Path to folder which contains the HTML5 client. (defaults to ./client)");
 
         po::variables_map vm;
@@ -60,10 +73,67 @@ int main(int argc, char** argv)
         if(vm.count("wssport"))
             wssPort = vm["wssport"].as<std::string>();
 
+        // number of websocket worker threads
+        size_t threads = 2;
+        if(vm.count("threads"))
+            threads = std::max<size_t>(vm["threads"].as<size_t>(), 1);
+
+        // inference engine
+        std::string engine = "dlib";
+        if(vm.count("engine"))
+            engine = vm["engine"].as<std::string>();
+
+        // cross request batching
+        size_t maxBatch = 0;
+        size_t batchWait = 1000;
+        if(vm.count("maxbatch"))
+            maxBatch = vm["maxbatch"].as<size_t>();
+        if(vm.count("batchwait"))
+            batchWait = vm["batchwait"].as<size_t>();
+
+        // confidence threshold of the cascade
+        float cascade = 0;
+        if(vm.count("cascade"))
+            cascade = vm["cascade"].as<float>();
+
+        // interval of checking the network file for changes
+        size_t watch = 0;
+        if(vm.count("watch"))
+            watch = vm["watch"].as<size_t>();
+
+        // resolution uploaded pictures are decoded at
+        size_t workingSize = 1024;
+        if(vm.count("workingsize"))
+            workingSize = vm["workingsize"].as<size_t>();
+
+        // worker pool shared by all requests
+        size_t workers = std::thread::hardware_concurrency();
+        if(vm.count("workers"))
+            workers = vm["workers"].as<size_t>();
+
+        // multi-pass voting
+        size_t voteBudget = 50;
+        if(vm.count("votebudget"))
+            voteBudget = vm["votebudget"].as<size_t>();
+
+        // candidate network evaluated in shadow mode
+        std::filesystem::path shadow;
+        double shadowFraction = 0.1;
+        if(vm.count("shadow"))
+            shadow = vm["shadow"].as<std::string>();
+        if(vm.count("shadowfraction"))
+            shadowFraction = vm["shadowfraction"].as<double>();
+
         // path to mnist folder
         std::filesystem::path mnistPath = "mnist";
         if(vm.count("mnist"))
             mnistPath = vm["mnist"].as<std::string>();
+        else if(lenet::embeddedWeights()) {
+            // single file deployment, the static engine runs the weights compiled into the executable
+            mnistPath.clear();
+            if(!vm.count("engine"))
+                engine = "static";
+        }
 
         // path to html5 client
         std::filesystem::path clientPath = "client";
@@ -71,11 +141,29 @@ int main(int argc, char** argv)
             clientPath = vm["client"].as<std::string>();
 
         // create network instance, ctor will automatically train a new network if none exists
-        MNISTLeNet::SPtr network = std::make_shared<MNISTLeNet>(mnistPath);
+        MNISTLeNet::SPtr network = std::make_shared<MNISTLeNet>(mnistPath, threads, engine);
+        network->setBatching(maxBatch, std::chrono::microseconds(batchWait));
+        network->setCascade(cascade);
+        network->watch(std::chrono::seconds(watch));
+        network->setShadow(shadow, shadowFraction);
+        network->setWorkingSize(workingSize);
+        network->setWorkers(workers);
+        network->setVoting(std::chrono::milliseconds(voteBudget));
+
+        // compare inference engines instead of running the service
+        if(vm.count("benchmark")) {
+            network->benchmark();
+            return EXIT_SUCCESS;
+        }
+
+        if(vm.count("export")) {
+            network->exportWeights();
+            return EXIT_SUCCESS;
+        }
 
         // websocket server for client interaction
         WSSObserver::SPtr obs = std::make_shared<WSSObserver>(network); // observer handling requests
-        WebSocketServer::SPtr wssrv = std::make_shared<WebSocketServer>("0.0.0.0", wssPort, ssl , 2, certFile, keyFile);
+        WebSocketServer::SPtr wssrv = std::make_shared<WebSocketServer>("0.0.0.0", wssPort, ssl , threads, certFile, keyFile);
         wssrv->subscribe(obs);
         wssrv->run();
 
@@ -95,11 +183,25 @@ int main(int argc, char** argv)
         std::cout << "Service running. Navigate your browser to: " << httpprotocol << host << ":" << httpPort  << std::endl;
         std::cout << "Websocket service URI: " << wsprotocol << host << ":" << wssPort << std::endl;
 
-        // exit by command:
+        // exit by command, stats prints usage statistics of the network, reload loads the network file again:
         std::string exit;
         while(exit != "exit"){
-            std::cout << "Enter exit to stop the program: " << std::endl;
+            std::cout << "Enter exit to stop the program, stats to print statistics or reload to load the network file again: " << std::endl;
             std::cin >> exit;
+            if(exit == "stats")
+                std::cout << network->statistics().ToString() << std::endl;
+            else if(exit == "reload") {
+                // requests are still served by the previous network while loading
+                try
+                {
+                    network->reload();
+                    std::cout << "Network reloaded." << std::endl;
+                }
+                catch(const ExceptionBase& e)
+                {
+                    std::cerr << "Reloading the network failed, the previous network is still used: " << e.getMessage() << std::endl;
+                }
+            }
         };
     }
     catch(const ExceptionBase& e){